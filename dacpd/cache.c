@@ -0,0 +1,157 @@
+/*
+ * DACP endpoint cache. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+
+#define CACHE_MAGIC   (0x44414350) /* 'DACP' */
+#define CACHE_VERSION (1)
+
+cache_t *cache_open(const char *path) {
+
+  cache_t *cache = (cache_t *)malloc(sizeof(cache_t));
+  if (cache == NULL) {
+    fprintf(stderr, "ERROR: Cannot allocate cache_t struct\n");
+    return NULL;
+  }
+
+  cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (cache->fd < 0) {
+    fprintf(stderr, "ERROR: Cannot open cache %s\n", path);
+    free(cache);
+    return NULL;
+  }
+
+  if (ftruncate(cache->fd, sizeof(cache_file_t)) < 0) {
+    fprintf(stderr, "ERROR: Cannot size cache %s\n", path);
+    close(cache->fd);
+    free(cache);
+    return NULL;
+  }
+
+  cache->map = (cache_file_t *)mmap(NULL, sizeof(cache_file_t), 
+    PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+  if (cache->map == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Cannot map cache %s\n", path);
+    close(cache->fd);
+    free(cache);
+    return NULL;
+  }
+
+  /* New file or old layout, start over */
+  if ((cache->map->magic != CACHE_MAGIC) || (cache->map->version != CACHE_VERSION)) {
+    memset(cache->map, 0, sizeof(cache_file_t));
+    cache->map->magic = CACHE_MAGIC;
+    cache->map->version = CACHE_VERSION;
+  }
+
+  return cache;
+
+}
+
+static cache_entry_t *cache_find(const cache_t *cache, const char *id) {
+
+  int i;
+  for (i = 0; i < CACHE_ENTRIES; i++) {
+    cache_entry_t *e = &cache->map->entries[i];
+    if ((e->id[0] != '\0') && !strncmp(e->id, id, sizeof(e->id))) {
+      return e;
+    }
+  }
+
+  return NULL;
+
+}
+
+int cache_get(const cache_t *cache, const char *id, cache_entry_t *e) {
+
+  if ((cache == NULL) || (id == NULL)) {
+    return 0;
+  }
+
+  cache_entry_t *found = cache_find(cache, id);
+  if (found == NULL) {
+    return 0;
+  }
+
+  memcpy(e, found, sizeof(cache_entry_t));
+  /* File contents are untrusted, make sure strings are terminated */
+  e->id[sizeof(e->id) - 1] = '\0';
+  e->addr[sizeof(e->addr) - 1] = '\0';
+
+  return 1;
+
+}
+
+void cache_put(cache_t *cache, const char *id, const char *addr, int port, int family) {
+
+  if ((cache == NULL) || (id == NULL) || (addr == NULL)) {
+    return;
+  }
+
+  cache_entry_t *e = cache_find(cache, id);
+
+  /* Not known yet, take over the least recently seen slot */
+  if (e == NULL) {
+    int i;
+    e = &cache->map->entries[0];
+    for (i = 1; i < CACHE_ENTRIES; i++) {
+      if (cache->map->entries[i].seen < e->seen) {
+        e = &cache->map->entries[i];
+      }
+    }
+    memset(e, 0, sizeof(cache_entry_t));
+    strncpy(e->id, id, sizeof(e->id) - 1);
+  }
+
+  memset(e->addr, 0, sizeof(e->addr));
+  strncpy(e->addr, addr, sizeof(e->addr) - 1);
+  e->port = port;
+  e->family = family;
+  e->seen = time(NULL);
+
+  msync(cache->map, sizeof(cache_file_t), MS_ASYNC);
+
+}
+
+void cache_close(cache_t *cache) {
+
+  if (cache == NULL) {
+    return;
+  }
+
+  msync(cache->map, sizeof(cache_file_t), MS_SYNC);
+  munmap(cache->map, sizeof(cache_file_t));
+  close(cache->fd);
+  free(cache);
+
+}
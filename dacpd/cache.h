@@ -0,0 +1,78 @@
+/*
+ * Persistent DACP endpoint cache. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Notes:
+ *   Resolving a DACP-ID via mDNS after a restart takes anywhere from
+ *   a fraction of a second to several seconds.  The handful of phones
+ *   that ever talk to the console rarely change address, so we keep
+ *   the last known endpoint for each DACP-ID in a small fixed size
+ *   file that is memory mapped.  Entries are only ever a hint; the
+ *   caller is expected to confirm them (probe, mDNS) before trusting.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+/* Number of endpoints remembered (least recently seen is replaced) */
+#define CACHE_ENTRIES (8)
+
+/* Single remembered endpoint */
+typedef struct {
+  char id[64];      /* DACP service name (iTunes_Ctrl_...) */
+  char addr[48];    /* Numeric address string */
+  int32_t port;     /* DACP port */
+  int32_t family;   /* AF_INET or AF_INET6 */
+  int64_t seen;     /* Time last confirmed (seconds since epoch) */
+} cache_entry_t;
+
+/* On disk layout */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  cache_entry_t entries[CACHE_ENTRIES];
+} cache_file_t;
+
+typedef struct {
+  int fd;
+  cache_file_t *map;
+} cache_t;
+
+/* Not thread safe, callers sharing a cache serialize get and put
+ * themselves (dacpd uses the monitor lock) */
+
+/* Opens (creating if needed) the cache file at path */
+cache_t *cache_open(const char *path);
+
+/* Copies the entry for id into e.  Returns 1 if found, 0 otherwise */
+int cache_get(const cache_t *cache, const char *id, cache_entry_t *e);
+
+/* Records (or refreshes) the endpoint for id */
+void cache_put(cache_t *cache, const char *id, const char *addr, int port, int family);
+
+/* Flushes and unmaps the cache */
+void cache_close(cache_t *cache);
+
+#endif /* CACHE_H */
@@ -0,0 +1,82 @@
+/*
+ * DACP message parsing and service name matching. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dacp.h"
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+/* Fields that don't fit the session storage are rejected rather than
+ * truncated. */
+int dacp_parse_open(const char *msg, char *srv_name, char *active_remote) {
+
+  int n = 0;
+
+  if (sscanf(msg, "dacp_open,%" STR(SRV_NAME_LEN) "[^,],%" STR(ACTIVE_REMOTE_LEN) "[^,]%n",
+        srv_name, active_remote, &n) != 2) {
+    return 0;
+  }
+
+  /* A too long srv_name already failed to match the ',' above */
+  if ((msg[n] != '\0') && (msg[n] != ',')) {
+    return 0;
+  }
+
+  /* Both end up quoted on a shell command line (run_dcap_cmd), so allow
+   * nothing beyond what shairport and the phones actually use */
+  if ((srv_name[strspn(srv_name, DACP_NAME_CHARS)] != '\0') ||
+      (active_remote[strspn(active_remote, DACP_REMOTE_CHARS)] != '\0')) {
+    return 0;
+  }
+
+  return 1;
+
+}
+
+int dacp_name_ismatch(const char *prefix, const char *name) {
+  // Strip off leading 0's of ID before comparison:
+  // Example:  iTunes_Ctrl_0F44ADA81654B1C9 => iTunes_Ctrl_F44ADA81654B1C9
+  // This is done on the fly while comparing, no copy of name is made.
+  int skip = 0;
+  while (*prefix != '\0') {
+    if (*name == '\0') {
+      return 0;
+    }
+    if (skip && (*name == '0')) {
+      name++;
+      continue;
+    }
+    skip = (*name == '_');
+    if (*name != *prefix) {
+      return 0;
+    }
+    name++;
+    prefix++;
+  }
+  return 1;
+}
@@ -0,0 +1,59 @@
+/*
+ * DACP message parsing and service name matching. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Notes:
+ *   Everything here runs on untrusted input: dacp_open messages arrive
+ *   over UDP from shairport (or anyone else on the box) and service
+ *   names come from mDNS browse results on the network.  It is kept
+ *   free of Avahi and sockets so it can be fuzzed and benchmarked on
+ *   its own, see fuzz/.
+ */
+
+#ifndef DACP_H
+#define DACP_H
+
+/* Session storage, sized for what shairport hands us.  Anything longer
+ * is rejected when the dacp_open message is parsed. */
+#define SRV_NAME_LEN 63
+#define ACTIVE_REMOTE_LEN 31
+
+/* Characters allowed in each, anything else is rejected as well */
+#define DACP_NAME_CHARS \
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_"
+#define DACP_REMOTE_CHARS "0123456789"
+
+/* Parses "dacp_open,<srv_name>,<active_remote>" into buffers of at
+ * least SRV_NAME_LEN+1 and ACTIVE_REMOTE_LEN+1 bytes.  Returns 1 on
+ * success, 0 if msg isn't a well formed dacp_open.  This is the trust
+ * boundary: srv_name is [A-Za-z0-9_]+ and active_remote is [0-9]+ on
+ * success, both are later pasted into a shell command. */
+int dacp_parse_open(const char *msg, char *srv_name, char *active_remote);
+
+/* Returns 1 if the browsed service name starts with prefix, ignoring
+ * leading zeros of the ID in name.  Shairport drops them from the
+ * DACP-ID, the phone doesn't:
+ *   iTunes_Ctrl_F44ADA81654B1C9 matches iTunes_Ctrl_0F44ADA81654B1C9 */
+int dacp_name_ismatch(const char *prefix, const char *name);
+
+#endif /* DACP_H */
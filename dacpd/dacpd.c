@@ -36,6 +36,9 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <sys/socket.h>
 #include <net/if.h>
@@ -43,6 +46,8 @@
 #include <netinet/tcp.h>
 
 #include <avahi-common/simple-watch.h>
+#include <avahi-common/thread-watch.h>
+#include <avahi-common/timeval.h>
 #include <avahi-common/error.h>
 #include <avahi-common/malloc.h>
 #include <avahi-common/domain.h>
@@ -51,21 +56,50 @@
 #include <avahi-client/lookup.h>
 
 #include "ipc.h"
+#include "cache.h"
+#include "metadata.h"
+#include "dacp.h"
 
 #define DACPD_PORT (3391)
 #define GPIOD_PORT (3392)
 
-static void *memdup(void *p, int size) {
-  void *r = malloc(size);
-  memcpy(r, p, size);
-  return r;
-}
+/* Give up on a DACP command that hasn't completed after X sec */
+#define CMD_TIMEOUT_SEC (2)
+
+/* HTTP client used for DACP commands.  The allocation test swaps in a
+ * stand-in so it doesn't depend on curl (or a phone) on the build host. */
+#ifndef DACP_HTTP_CLIENT
+#define DACP_HTTP_CLIENT "curl"
+#endif
+
+/* Volume change per volumeup/volumedown once the volume is known,
+ * same as gpiod's local step */
+#define VOLUME_STEP (5)
+
+/* Background reachability probe of the active session endpoint */
+#define PROBE_INTERVAL_SEC (5)
+#define PROBE_TIMEOUT_MSEC (250)
+
+/* While degraded, re-browse for the session on a backoff from
+ * PROBE_INTERVAL_SEC up to this */
+#define REBROWSE_MAX_SEC (60)
+
+/* Default location of the warm start endpoint cache */
+#define DACPD_CACHE "/var/cache/shairport-dacpd/endpoints"
+
+/* Default shairport-sync metadata pipe */
+#define DACPD_METADATA "/tmp/shairport-sync-metadata"
 
 typedef struct {
-  char addr[32];
+  char addr[AVAHI_ADDRESS_STR_MAX];
   int port;
+  int family;
 } host_t;
 
+static int address_family(const AvahiAddress *a) {
+  return (a->proto == AVAHI_PROTO_INET6) ? AF_INET6 : AF_INET;
+}
+
 typedef struct {
   AvahiSimplePoll *poll;
   AvahiClient *cli;
@@ -73,11 +107,12 @@ typedef struct {
   int ref_nr;
 
   struct {
-    char *name_prefix;
-    char *type;
+    const char *name_prefix;
+    const char *type;
   } match;
 
-  host_t *found;
+  host_t found;
+  int has_found;
 } ctx_t;
 
 static void client_callback(AvahiClient *cli, AvahiClientState state, void *ud);
@@ -111,11 +146,6 @@ cleanup:
     avahi_simple_poll_free(c->poll);
 }
 
-static void ctx_cleanup(ctx_t *c) {
-  if (c->found)
-    free(c->found);
-}
-
 static void ctx_ref(ctx_t *c) {
   c->ref_nr++;
 }
@@ -145,36 +175,9 @@ static srvctx_t *srvctx_unref(srvctx_t *sc) {
   free(sc);
 }
 
-static int startswith(char *s, char *pat) {
-  int n = strlen(pat);
-  return !strncmp(s, pat, n);
-}
-
 static int ctx_ismatch(ctx_t *c, const char *name) {
   if (c->match.name_prefix)  {
-    // Strip off leading 0's of ID before comparison:
-    // Example:  iTunes_Ctrl_0F44ADA81654B1C9 => iTunes_Ctrl_F44ADA81654B1C9
-    char *tname = (char *)malloc(strlen(name) + 1);
-    int ni = 0;
-    int ti = 0;
-    int skip = 0;
-    while (name[ni] != '\0') {
-      if (!(skip && (name[ni] == '0'))) {
-        tname[ti] = name[ni];
-        ti++;
-      }
-      if (skip && (name[ni] != '0')) {
-        skip = 0;
-      }
-      if (name[ni] == '_') {
-        skip = 1;
-      } 
-      ni++;
-    }
-    tname[ti] = '\0';
-    ti = startswith(tname, c->match.name_prefix);
-    free(tname);
-    return ti;
+    return dacp_name_ismatch(c->match.name_prefix, name);
   }
   return 1;
 }
@@ -207,12 +210,10 @@ static void service_resolver_callback(
       ctx_t *c = sc->c;
 
       if (ctx_ismatch(c, name)) {
-        if (c->found)
-          free(c->found);
-
-        c->found = (host_t *)malloc(sizeof(host_t));
-        strcpy(c->found->addr, address);
-        c->found->port = port;
+        strcpy(c->found.addr, address);
+        c->found.port = port;
+        c->found.family = address_family(a);
+        c->has_found = 1;
       } else {
         fprintf(stderr, "resolve: name not match(%s vs %s)\n", name, c->match.name_prefix);
       }
@@ -300,26 +301,230 @@ static void client_callback(AvahiClient *cli, AvahiClientState state, void *ud)
   }
 }
 
-static void run_dcap_cmd(host_t *host, char *msg, char *active_remote) {
+static int run_dcap_cmd(const host_t *host, const char *msg, const char *active_remote) {
 
   if ((host == NULL) || (msg == NULL) || (active_remote == NULL)) {
-    return;
+    return -1;
   }
 
   int rc;
-  char *cmd = (char *)malloc(128 + strlen(active_remote));
-  sprintf(cmd, "curl 'http://%s:%d/ctrl-int/1/%s' -H 'Active-Remote: %s' -H 'Host: starlight.local.'", 
-      host->addr, host->port, msg, active_remote);
+  char cmd[512];
+  int v6 = (host->family == AF_INET6);
+  rc = snprintf(cmd, sizeof(cmd), "%s -s -f -o /dev/null -m %d 'http://%s%s%s:%d/ctrl-int/1/%s' -H 'Active-Remote: %s' -H 'Host: starlight.local.'", 
+      DACP_HTTP_CLIENT, CMD_TIMEOUT_SEC, v6 ? "[" : "", host->addr, v6 ? "]" : "", host->port, msg, active_remote);
+  if ((rc < 0) || (rc >= (int)sizeof(cmd))) {
+    fprintf(stderr, "cmd: %s too long\n", msg);
+    return -1;
+  }
   fprintf(stderr, "cmd: %s\n", cmd);
   rc = system(cmd);
-  free(cmd);
+
+  if (rc != 0) {
+    fprintf(stderr, "cmd: %s failed rc=%d\n", msg, rc);
+    return -1;
+  }
+
+  return 0;
+
+}
+
+/* Starts a non-blocking TCP connect to the DACP port.  Returns 1 if it
+ * connected right away, 0 if it is in progress (wait for *fd to become
+ * writable), -1 on failure.  *fd must be closed unless -1 is returned. */
+static int host_connect(const host_t *host, int *fd) {
+
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  memset(&sa, 0, sizeof(sa));
+  if (host->family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sa;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(host->port);
+    if (inet_pton(AF_INET6, host->addr, &sin6->sin6_addr) != 1) {
+      return -1;
+    }
+    salen = sizeof(*sin6);
+  } else {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&sa;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(host->port);
+    if (inet_pton(AF_INET, host->addr, &sin->sin_addr) != 1) {
+      return -1;
+    }
+    salen = sizeof(*sin);
+  }
+
+  *fd = socket(host->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (*fd < 0) {
+    return -1;
+  }
+
+  if (connect(*fd, (struct sockaddr *)&sa, salen) == 0) {
+    return 1;
+  }
+  if (errno == EINPROGRESS) {
+    return 0;
+  }
+
+  close(*fd);
+  return -1;
 
 }
 
+/* Result of a connect started by host_connect() once fd is writable */
+static int host_connected(int fd) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+  return (err == 0);
+}
+
+/* Cheap reachability check: a TCP connect to the DACP port, blocking
+ * for up to timeout_ms.  The monitor runs the same check without
+ * blocking, see monitor_probe_start(). */
+static int host_probe(const host_t *host, int timeout_ms) {
+
+  int fd;
+  int ok = host_connect(host, &fd);
+  if (ok < 0) {
+    return 0;
+  }
+
+  if (ok == 0) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    ok = (poll(&pfd, 1, timeout_ms) == 1) && host_connected(fd);
+  }
+
+  close(fd);
+  return ok;
+
+}
+
+/*
+ * State updates for gpiod.  A reliable send blocks for up to ~600 msec
+ * while gpiod is down or restarting, which must stall neither the avahi
+ * thread (its callbacks run with the poll lock held) nor the message
+ * loop.  Updates are queued here and sent in order from a thread of
+ * their own.  Only string literals are queued, so posting never copies
+ * or allocates.
+ */
+#define NOTIFY_QUEUE (16)
+
 typedef struct {
-  host_t *host;
-  char *srv_name;
-  char *active_remote;
+  ipc_cli_t *gpiod;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  const char *queue[NOTIFY_QUEUE];
+  int head;
+  int count;
+  int busy;         /* A message is being sent */
+  int stop;
+  int running;      /* Thread started, otherwise send inline */
+} notify_t;
+
+static void *notify_thread(void *ud) {
+
+  notify_t *n = (notify_t *)ud;
+
+  pthread_mutex_lock(&n->lock);
+  while (1) {
+
+    if (n->count == 0) {
+      n->busy = 0;
+      pthread_cond_broadcast(&n->cond);
+      if (n->stop) {
+        break;
+      }
+      pthread_cond_wait(&n->cond, &n->lock);
+      continue;
+    }
+
+    const char *msg = n->queue[n->head];
+    n->head = (n->head + 1) % NOTIFY_QUEUE;
+    n->count--;
+    n->busy = 1;
+
+    pthread_mutex_unlock(&n->lock);
+    if (ipc_cli_send_reliable(n->gpiod, msg) < 0) {
+      fprintf(stderr, "notify: gpiod did not ack %s\n", msg);
+    }
+    pthread_mutex_lock(&n->lock);
+
+  }
+  pthread_mutex_unlock(&n->lock);
+
+  return NULL;
+
+}
+
+static void notify_start(notify_t *n, ipc_cli_t *gpiod) {
+
+  memset(n, 0, sizeof(*n));
+  n->gpiod = gpiod;
+  pthread_mutex_init(&n->lock, NULL);
+  pthread_cond_init(&n->cond, NULL);
+
+  if (pthread_create(&n->thread, NULL, notify_thread, n) != 0) {
+    fprintf(stderr, "notify: cannot start thread, sending inline\n");
+    return;
+  }
+  n->running = 1;
+
+}
+
+/* Queues msg (a string literal) for gpiod.  If gpiod has been away long
+ * enough for the queue to fill up, the oldest update is dropped. */
+static void notify_post(notify_t *n, const char *msg) {
+
+  if (!n->running) {
+    ipc_cli_send_reliable(n->gpiod, msg);
+    return;
+  }
+
+  pthread_mutex_lock(&n->lock);
+  if (n->count == NOTIFY_QUEUE) {
+    fprintf(stderr, "notify: queue full, dropping %s\n", n->queue[n->head]);
+    n->head = (n->head + 1) % NOTIFY_QUEUE;
+    n->count--;
+  }
+  n->queue[(n->head + n->count) % NOTIFY_QUEUE] = msg;
+  n->count++;
+  pthread_cond_broadcast(&n->cond);
+  pthread_mutex_unlock(&n->lock);
+
+}
+
+/* Waits until everything queued has been sent */
+static void notify_flush(notify_t *n) {
+  pthread_mutex_lock(&n->lock);
+  while (n->running && (n->count || n->busy)) {
+    pthread_cond_wait(&n->cond, &n->lock);
+  }
+  pthread_mutex_unlock(&n->lock);
+}
+
+/* Sends what is still queued, then stops the thread */
+static void notify_stop(notify_t *n) {
+  if (!n->running) {
+    return;
+  }
+  pthread_mutex_lock(&n->lock);
+  n->stop = 1;
+  pthread_cond_broadcast(&n->cond);
+  pthread_mutex_unlock(&n->lock);
+  pthread_join(n->thread, NULL);
+  n->running = 0;
+}
+
+/* Active session.  All storage is fixed size and lives in the struct,
+ * the session itself never needs the heap (an avahi resolve does). */
+typedef struct {
+  host_t host;
+  int resolved;                               /* host is valid */
+  char srv_name[SRV_NAME_LEN + 1];            /* empty when no session */
+  char active_remote[ACTIVE_REMOTE_LEN + 1];
+  int reachable; /* -1=unknown, 0=degraded, 1=reachable */
 } srv_t;
 
 enum {
@@ -328,103 +533,1009 @@ enum {
   RESOLVED,
 };
 
-static void srv_free(srv_t *srv) {
+static void srv_reset(srv_t *srv) {
+  srv->resolved = 0;
+  srv->srv_name[0] = '\0';
+  srv->active_remote[0] = '\0';
+  srv->reachable = -1;
+}
 
-  if (srv->srv_name) {
-    free(srv->srv_name);
-    srv->srv_name = NULL;
-  }
+/* Tells gpiod whenever the session endpoint changes between reachable
+ * (dacp_open) and unreachable (dacp_degraded).  Session state goes out
+ * reliably, a lost message would leave the LEDs wrong for a while.  Safe
+ * to call with the monitor locked, the send happens on the notify thread. */
+static void srv_set_reachable(srv_t *srv, notify_t *notify, int reachable) {
 
-  if (srv->active_remote) {
-    free(srv->active_remote);
-    srv->active_remote = NULL;
+  if (srv->reachable == reachable) {
+    return;
   }
 
-  if (srv->host) {
-    free(srv->host);
-    srv->host = NULL;
-  }
+  srv->reachable = reachable;
+  fprintf(stderr, "session: %s %s\n", srv->srv_name[0] ? srv->srv_name : "-", 
+    reachable ? "reachable" : "degraded");
+  notify_post(notify, reachable ? "dacp_open" : "dacp_degraded");
 
 }
 
-static int resolve_itunes_ctrl(srv_t *srv, char *srv_name, char *active_remote) {
+static void srv_set_host(srv_t *srv, const host_t *host) {
+  memcpy(&srv->host, host, sizeof(host_t));
+  srv->resolved = 1;
+}
 
-  srv_free(srv);
+static int resolve_itunes_ctrl(host_t *host, const char *srv_name) {
 
-  fprintf(stderr, "resolve: srv=%s active_remote=%s\n", srv_name, active_remote);
+  fprintf(stderr, "resolve: srv=%s\n", srv_name);
 
   ctx_t rsv = { .match = {.name_prefix = srv_name, .type = "_dacp._tcp"} };
   ctx_find_service(&rsv);
 
-  if (rsv.found) {
-    srv->srv_name = strdup(srv_name);
-    srv->active_remote = strdup(active_remote);
-    srv->host = (host_t *)memdup(rsv.found, sizeof(host_t));
-    fprintf(stderr, "resolve: host=%s:%d srvname=%s\n", srv->host->addr, srv->host->port, srv->srv_name);
+  if (rsv.has_found) {
+    memcpy(host, &rsv.found, sizeof(host_t));
+    fprintf(stderr, "resolve: host=%s:%d srvname=%s\n", host->addr, host->port, srv_name);
   } else {
     fprintf(stderr, "resolve: srv=%s failed\n", srv_name);
   }
 
-  ctx_cleanup(&rsv);
+  return rsv.has_found;
+}
 
-  return !!rsv.found;
+/*
+ * Background reachability monitor.  Phones change DACP port when they
+ * roam between access points or wake from sleep.  Rather than finding
+ * out on the next (failed) button press, we keep a long lived browser
+ * on the DACP service type running in its own avahi thread.  REMOVE/NEW
+ * events for the active session's DACP-ID mark the session degraded or
+ * re-resolve it as they happen, and a periodic TCP connect probe catches
+ * endpoints that silently went away.  A resolved endpoint only counts as
+ * reachable once it answers the probe.  While degraded, the session is
+ * re-browsed on a backoff, in case the phone moved without announcing
+ * it or the first answer came from a stale cache.
+ *
+ * All callbacks run on the avahi thread with the poll lock held.  The
+ * main thread must wrap any access to the session in monitor_lock() and
+ * monitor_unlock().  Nothing here may block: probes are non-blocking
+ * connects completed from avahi watches.
+ */
+#define MONITOR_PROBES (4)
+
+struct monitor;
+
+/* A connect probe in flight on the avahi thread */
+typedef struct {
+  struct monitor *m;
+  int fd;                            /* -1 when the slot is free */
+  int resolved;                      /* Fresh resolver result, else the periodic probe */
+  host_t host;
+  char srv_name[SRV_NAME_LEN + 1];   /* Session the probe is for */
+  AvahiWatch *watch;
+  AvahiTimeout *timeout;
+} probe_t;
+
+typedef struct monitor {
+  AvahiThreadedPoll *poll;
+  AvahiClient *cli;
+  AvahiServiceBrowser *br;
+  AvahiTimeout *probe;
+  probe_t probes[MONITOR_PROBES];
+  int rebrowse_sec;                  /* Current backoff, 0 when reachable */
+  int rebrowse_left;
+  srv_t *srv;
+  notify_t *notify;
+  cache_t *cache;
+} monitor_t;
+
+/* Installs a confirmed endpoint for the session and remembers it for
+ * the next time this DACP-ID shows up (possibly after a restart) */
+static void monitor_learn(monitor_t *m, const host_t *host) {
+
+  srv_t *srv = m->srv;
+
+  if (srv->resolved && 
+      ((strcmp(srv->host.addr, host->addr) != 0) || (srv->host.port != host->port))) {
+    fprintf(stderr, "monitor: %s moved %s:%d => %s:%d\n", srv->srv_name,
+      srv->host.addr, srv->host.port, host->addr, host->port);
+  }
+
+  srv_set_host(srv, host);
+  cache_put(m->cache, srv->srv_name, host->addr, host->port, host->family);
+
+}
+
+static void monitor_lock(monitor_t *m) {
+  if (m->poll)
+    avahi_threaded_poll_lock(m->poll);
+}
+
+static void monitor_unlock(monitor_t *m) {
+  if (m->poll)
+    avahi_threaded_poll_unlock(m->poll);
+}
+
+static void monitor_browse(monitor_t *m);
+
+/* Marks the session degraded and re-browses right away, the probe tick
+ * keeps re-browsing on a backoff from there */
+static void monitor_degrade(monitor_t *m) {
+  srv_set_reachable(m->srv, m->notify, 0);
+  m->rebrowse_sec = PROBE_INTERVAL_SEC;
+  m->rebrowse_left = m->rebrowse_sec;
+  monitor_browse(m);
+}
+
+/* Acts on a probe of host for session srv_name, which may have been
+ * closed or replaced while the probe was in flight */
+static void monitor_probe_result(monitor_t *m, const char *srv_name, const host_t *host, int resolved, int ok) {
+
+  srv_t *srv = m->srv;
+
+  if (strcmp(srv->srv_name, srv_name) != 0) {
+    return;
+  }
+
+  if (resolved) {
+    if (ok) {
+      fprintf(stderr, "monitor: host=%s:%d srvname=%s\n", host->addr, host->port, srv_name);
+      monitor_learn(m, host);
+      srv_set_reachable(srv, m->notify, 1);
+    } else {
+      fprintf(stderr, "monitor: host=%s:%d srvname=%s not answering\n", host->addr, host->port, srv_name);
+    }
+    return;
+  }
+
+  /* Periodic probe of an endpoint that has been replaced since */
+  if (!srv->resolved || strcmp(srv->host.addr, host->addr) || (srv->host.port != host->port)) {
+    return;
+  }
+
+  if (ok) {
+    srv_set_reachable(srv, m->notify, 1);
+  } else if (srv->reachable != 0) {
+    monitor_degrade(m);
+  }
+
+}
+
+static void monitor_probe_done(probe_t *p, int ok) {
+
+  monitor_t *m = p->m;
+  const AvahiPoll *api = avahi_threaded_poll_get(m->poll);
+  host_t host = p->host;
+  char srv_name[SRV_NAME_LEN + 1];
+  strcpy(srv_name, p->srv_name);
+
+  api->watch_free(p->watch);
+  api->timeout_free(p->timeout);
+  close(p->fd);
+  p->fd = -1;
+
+  monitor_probe_result(m, srv_name, &host, p->resolved, ok);
+
+}
+
+static void monitor_probe_watch(AVAHI_GCC_UNUSED AvahiWatch *w, int fd, AVAHI_GCC_UNUSED AvahiWatchEvent event, void *ud) {
+  monitor_probe_done((probe_t *)ud, host_connected(fd));
+}
+
+static void monitor_probe_timeout(AVAHI_GCC_UNUSED AvahiTimeout *t, void *ud) {
+  monitor_probe_done((probe_t *)ud, 0);
+}
+
+/* Probes host for the current session without blocking the avahi
+ * thread.  resolved is set for endpoints fresh from the resolver, which
+ * are learned if they answer. */
+static void monitor_probe_start(monitor_t *m, const host_t *host, int resolved) {
+
+  const AvahiPoll *api = avahi_threaded_poll_get(m->poll);
+  probe_t *p = NULL;
+  int fd, i;
+
+  for (i = 0; i < MONITOR_PROBES; i++) {
+    if (m->probes[i].fd < 0) {
+      p = &m->probes[i];
+      break;
+    }
+  }
+  if (p == NULL) {
+    fprintf(stderr, "monitor: too many probes, skipping %s:%d\n", host->addr, host->port);
+    return;
+  }
+
+  int rc = host_connect(host, &fd);
+  if (rc == 1) {
+    close(fd);
+  }
+  if (rc != 0) {
+    monitor_probe_result(m, m->srv->srv_name, host, resolved, rc == 1);
+    return;
+  }
+
+  p->m = m;
+  p->host = *host;
+  p->resolved = resolved;
+  strcpy(p->srv_name, m->srv->srv_name);
+
+  struct timeval tv;
+  p->watch = api->watch_new(api, fd, AVAHI_WATCH_OUT, monitor_probe_watch, p);
+  p->timeout = api->timeout_new(api, avahi_elapse_time(&tv, PROBE_TIMEOUT_MSEC, 0), monitor_probe_timeout, p);
+  if ((p->watch == NULL) || (p->timeout == NULL)) {
+    if (p->watch)
+      api->watch_free(p->watch);
+    if (p->timeout)
+      api->timeout_free(p->timeout);
+    close(fd);
+    monitor_probe_result(m, m->srv->srv_name, host, resolved, 0);
+    return;
+  }
+  p->fd = fd;
+
+}
+
+static void monitor_resolver_callback(
+    AvahiServiceResolver *r,
+    AVAHI_GCC_UNUSED AvahiIfIndex interface,
+    AVAHI_GCC_UNUSED AvahiProtocol protocol,
+    AvahiResolverEvent event,
+    const char *name,
+    AVAHI_GCC_UNUSED const char *type,
+    AVAHI_GCC_UNUSED const char *domain,
+    AVAHI_GCC_UNUSED const char *host_name,
+    const AvahiAddress *a,
+    uint16_t port,
+    AVAHI_GCC_UNUSED AvahiStringList *txt,
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    void *ud)
+{
+  monitor_t *m = (monitor_t *)ud;
+  srv_t *srv = m->srv;
+
+  /* Session may have closed (or changed) while we were resolving */
+  if ((event == AVAHI_RESOLVER_FOUND) && srv->srv_name[0] && dacp_name_ismatch(srv->srv_name, name)) {
+    host_t host;
+    avahi_address_snprint(host.addr, sizeof(host.addr), a);
+    host.port = port;
+    host.family = address_family(a);
+    /* A sleeping phone's record lingers in the avahi cache (or is
+     * answered by a sleep proxy), so only trust what answers */
+    monitor_probe_start(m, &host, 1);
+  }
+
+  avahi_service_resolver_free(r);
 }
 
+static void monitor_browser_callback(
+    AVAHI_GCC_UNUSED AvahiServiceBrowser *b,
+    AvahiIfIndex interface,
+    AvahiProtocol protocol,
+    AvahiBrowserEvent event,
+    const char *name,
+    const char *type,
+    const char *domain,
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    void *ud)
+{
+  monitor_t *m = (monitor_t *)ud;
+  srv_t *srv = m->srv;
+
+  if ((name == NULL) || (srv->srv_name[0] == '\0') || !dacp_name_ismatch(srv->srv_name, name)) {
+    return;
+  }
+
+  fprintf(stderr, "monitor: browser event=%s name=%s\n", browser_event_to_string(event), name);
+
+  switch (event) {
+  case AVAHI_BROWSER_NEW:
+    if (avahi_service_resolver_new(m->cli, interface, protocol, name, type, domain,
+          AVAHI_PROTO_UNSPEC, 0, monitor_resolver_callback, m) == NULL) {
+      fprintf(stderr, "monitor: cannot resolve %s\n", name);
+    }
+    break;
+
+  case AVAHI_BROWSER_REMOVE:
+    srv_set_reachable(srv, m->notify, 0);
+    break;
+
+  default:
+    break;
+  }
+}
+
+/* (Re)creates the browser.  A fresh browser replays NEW for everything
+ * currently on the network, which re-resolves the session endpoint. */
+static void monitor_browse(monitor_t *m) {
+
+  if (m->poll == NULL) {
+    return;
+  }
+
+  if (m->br) {
+    avahi_service_browser_free(m->br);
+    m->br = NULL;
+  }
+
+  if (avahi_client_get_state(m->cli) != AVAHI_CLIENT_S_RUNNING) {
+    return;
+  }
+
+  m->br = avahi_service_browser_new(m->cli, AVAHI_IF_UNSPEC, AVAHI_PROTO_INET,
+    "_dacp._tcp", NULL, 0, monitor_browser_callback, m);
+  if (m->br == NULL) {
+    fprintf(stderr, "monitor: cannot create browser: %s\n", 
+      avahi_strerror(avahi_client_errno(m->cli)));
+  }
+
+}
+
+static void monitor_probe_callback(AvahiTimeout *t, void *ud) {
+
+  monitor_t *m = (monitor_t *)ud;
+  srv_t *srv = m->srv;
+
+  if (srv->srv_name[0]) {
+    /* While degraded the phone may have moved without a REMOVE/NEW, or
+     * the last answer came from a stale cache, so keep looking */
+    if (srv->reachable != 0) {
+      m->rebrowse_sec = 0;
+      m->rebrowse_left = 0;
+    } else if ((m->rebrowse_left -= PROBE_INTERVAL_SEC) <= 0) {
+      m->rebrowse_sec = m->rebrowse_sec ? 2 * m->rebrowse_sec : PROBE_INTERVAL_SEC;
+      if (m->rebrowse_sec > REBROWSE_MAX_SEC)
+        m->rebrowse_sec = REBROWSE_MAX_SEC;
+      m->rebrowse_left = m->rebrowse_sec;
+      fprintf(stderr, "monitor: %s degraded, browsing (next in %ds)\n", srv->srv_name, m->rebrowse_sec);
+      monitor_browse(m);
+    }
+
+    if (srv->resolved) {
+      monitor_probe_start(m, &srv->host, 0);
+    } else if (srv->reachable != 0) {
+      monitor_degrade(m);
+    }
+  }
+
+  struct timeval tv;
+  avahi_threaded_poll_get(m->poll)->timeout_update(t, 
+    avahi_elapse_time(&tv, PROBE_INTERVAL_SEC * 1000, 0));
+
+}
+
+static void monitor_client_callback(AvahiClient *cli, AvahiClientState state, void *ud) {
+
+  monitor_t *m = (monitor_t *)ud;
+
+  switch (state) {
+  case AVAHI_CLIENT_S_RUNNING:
+    m->cli = cli;
+    monitor_browse(m);
+    break;
+
+  /* Daemon went away, the browser is dead.  NO_FAIL brings us back to
+   * RUNNING once it returns. */
+  case AVAHI_CLIENT_CONNECTING:
+  case AVAHI_CLIENT_FAILURE:
+    if (m->br) {
+      avahi_service_browser_free(m->br);
+      m->br = NULL;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+}
+
+static int monitor_start(monitor_t *m, srv_t *srv, notify_t *notify, cache_t *cache) {
+
+  memset(m, 0, sizeof(*m));
+  m->srv = srv;
+  m->notify = notify;
+  m->cache = cache;
+
+  int i;
+  for (i = 0; i < MONITOR_PROBES; i++) {
+    m->probes[i].fd = -1;
+  }
+
+  m->poll = avahi_threaded_poll_new();
+  if (m->poll == NULL) {
+    fprintf(stderr, "monitor: failed to create threaded poll object\n");
+    return -1;
+  }
+
+  int err;
+  m->cli = avahi_client_new(avahi_threaded_poll_get(m->poll), AVAHI_CLIENT_NO_FAIL,
+    monitor_client_callback, m, &err);
+  if (m->cli == NULL) {
+    fprintf(stderr, "monitor: failed to create client object: %s\n", avahi_strerror(err));
+    avahi_threaded_poll_free(m->poll);
+    m->poll = NULL;
+    return -1;
+  }
+
+  struct timeval tv;
+  m->probe = avahi_threaded_poll_get(m->poll)->timeout_new(avahi_threaded_poll_get(m->poll),
+    avahi_elapse_time(&tv, PROBE_INTERVAL_SEC * 1000, 0), monitor_probe_callback, m);
+
+  if (avahi_threaded_poll_start(m->poll) < 0) {
+    fprintf(stderr, "monitor: failed to start avahi thread\n");
+    avahi_client_free(m->cli);
+    avahi_threaded_poll_free(m->poll);
+    m->cli = NULL;
+    m->poll = NULL;
+    return -1;
+  }
+
+  return 0;
+
+}
+
+static void monitor_stop(monitor_t *m) {
+
+  if (m->poll == NULL) {
+    return;
+  }
+
+  avahi_threaded_poll_stop(m->poll);
+
+  /* Their watches go with the poll */
+  int i;
+  for (i = 0; i < MONITOR_PROBES; i++) {
+    if (m->probes[i].fd >= 0) {
+      close(m->probes[i].fd);
+    }
+  }
+
+  if (m->br)
+    avahi_service_browser_free(m->br);
+  avahi_client_free(m->cli);
+  avahi_threaded_poll_free(m->poll);
+  m->poll = NULL;
+
+}
+
+/* Set from main when systemd runs us with WatchdogSec */
+static int g_watchdog;
+
+/* Keeps the systemd watchdog fed from long running steps (resolves can
+ * take ~5 sec each) that keep the main loop from getting back to poll. */
+static void watchdog_ping(void) {
+  if (g_watchdog) {
+    ipc_notify("WATCHDOG=1");
+  }
+}
+
+/* Sends a playback command to the session.  A failed command means the
+ * endpoint moved before the monitor noticed, so re-resolve and retry once.
+ * Returns 0 if the client accepted the command, -1 otherwise. */
+static int srv_cmd(monitor_t *mon, srv_t *srv, const char *msg) {
+
+  host_t host;
+  char name[SRV_NAME_LEN + 1];
+  char remote[ACTIVE_REMOTE_LEN + 1];
+
+  monitor_lock(mon);
+  int active = srv->resolved;
+  if (active) {
+    host = srv->host;
+    strcpy(name, srv->srv_name);
+    strcpy(remote, srv->active_remote);
+  }
+  monitor_unlock(mon);
+
+  if (!active) {
+    return -1;
+  }
+  if (run_dcap_cmd(&host, msg, remote) == 0) {
+    return 0;
+  }
+
+  watchdog_ping();
+  int found = resolve_itunes_ctrl(&host, name);
+  watchdog_ping();
+
+  monitor_lock(mon);
+  /* Session may have been closed in the mean time */
+  int same = !strcmp(srv->srv_name, name);
+  if (same && found)
+    monitor_learn(mon, &host);
+  if (same)
+    srv_set_reachable(srv, mon->notify, found);
+  monitor_unlock(mon);
+
+  if (same && found)
+    return run_dcap_cmd(&host, msg, remote);
+
+  return -1;
+
+}
+
+/* Opens a new session.  A cached endpoint that answers a probe is used
+ * right away while the monitor confirms it via mDNS in the background,
+ * otherwise we fall back to resolving from scratch. */
+static void srv_open(monitor_t *mon, srv_t *srv, const char *srv_name, const char *active_remote) {
+
+  host_t host;
+  cache_entry_t e;
+  int found = 0;
+
+  /* The avahi thread writes the cache from monitor_learn() */
+  monitor_lock(mon);
+  int cached = cache_get(mon->cache, srv_name, &e);
+  monitor_unlock(mon);
+
+  if (cached) {
+    snprintf(host.addr, sizeof(host.addr), "%s", e.addr);
+    host.port = e.port;
+    host.family = e.family;
+    found = host_probe(&host, PROBE_TIMEOUT_MSEC);
+    fprintf(stderr, "cache: %s => %s:%d %s\n", srv_name, host.addr, host.port,
+      found ? "reachable" : "stale");
+  }
+
+  /* Up to a minute all told, so feed the watchdog every round */
+  int n = 10;
+  while (!found && (n > 0)) {
+    watchdog_ping();
+    if ((found = resolve_itunes_ctrl(&host, srv_name)))
+      break;
+    sleep(1);
+    n--;
+  }
+  watchdog_ping();
+
+  monitor_lock(mon);
+  srv_reset(srv);
+  strcpy(srv->srv_name, srv_name);
+  strcpy(srv->active_remote, active_remote);
+  if (found)
+    monitor_learn(mon, &host);
+  srv_set_reachable(srv, mon->notify, found);
+  /* Replay the browse so mDNS confirms (or corrects) the endpoint */
+  monitor_browse(mon);
+  monitor_unlock(mon);
+
+}
+
+/* Now playing state as reported by the shairport metadata pipe */
+typedef struct {
+  int playing;      /* -1=unknown, 0=paused/stopped, 1=playing */
+  int volume;       /* -1=unknown, else 0-100 */
+  int muted;        /* -1=unknown, 0=no, 1=yes */
+  notify_t *notify;
+} player_t;
+
+static void player_set_playing(player_t *pl, int playing) {
+
+  if (pl->playing == playing) {
+    return;
+  }
+
+  pl->playing = playing;
+  fprintf(stderr, "player: %s\n", playing ? "playing" : "paused");
+  notify_post(pl->notify, playing ? "playing" : "paused");
+
+}
+
+/* Passes volume/mute on to gpiod.  Fire and forget like the button
+ * messages, a newer value makes a lost one irrelevant. */
+static void player_set_volume(player_t *pl, int volume, int muted) {
+
+  char msg[16];
+
+  if (volume != pl->volume) {
+    pl->volume = volume;
+    snprintf(msg, sizeof(msg), "volume,%d", volume);
+    ipc_cli_send(pl->notify->gpiod, msg);
+  }
+
+  if (muted != pl->muted) {
+    pl->muted = muted;
+    snprintf(msg, sizeof(msg), "mute,%d", muted);
+    ipc_cli_send(pl->notify->gpiod, msg);
+  }
+
+  fprintf(stderr, "player: volume %d%s\n", pl->volume, pl->muted ? " (muted)" : "");
+
+}
+
+/* Metadata item callback */
+static void player_item(uint32_t type, uint32_t code, const char *data, int len, void *ud) {
+
+  player_t *pl = (player_t *)ud;
+  float av;
+
+  if (type == MD_CODE('c','o','r','e')) {
+    if ((code == MD_CODE('m','i','n','m')) && data) {
+      fprintf(stderr, "player: track %s\n", data);
+    }
+    return;
+  }
+
+  if (type != MD_CODE('s','s','n','c')) {
+    return;
+  }
+
+  switch (code) {
+  /* Stream begin/resume */
+  case MD_CODE('p','b','e','g'):
+  case MD_CODE('p','r','s','m'):
+    player_set_playing(pl, 1);
+    break;
+
+  /* Flush (pause) and stream end */
+  case MD_CODE('p','f','l','s'):
+  case MD_CODE('p','e','n','d'):
+    player_set_playing(pl, 0);
+    break;
+
+  /* "airplay_volume,volume,lowest,highest" where airplay_volume runs
+   * from -30 (quietest) to 0, and -144 means muted */
+  case MD_CODE('p','v','o','l'):
+    if (data && (sscanf(data, "%f", &av) == 1)) {
+      int volume = pl->volume;
+      int muted = (av <= -144.0f);
+      /* Muting keeps the volume to come back to */
+      if (!muted) {
+        volume = (int)((av + 30.0f) * 100.0f / 30.0f + 0.5f);
+        if (volume < 0)   volume = 0;
+        if (volume > 100) volume = 100;
+      }
+      player_set_volume(pl, volume, muted);
+    }
+    break;
+  }
+
+}
+
+/* Opens the metadata pipe, creating it if shairport hasn't yet */
+static int metadata_open(const char *path) {
+
+  if ((mkfifo(path, 0666) < 0) && (errno != EEXIST)) {
+    fprintf(stderr, "metadata: cannot create %s\n", path);
+    return -1;
+  }
+
+  /* Opened read/write so we never see EOF while shairport restarts */
+  int fd = open(path, O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    fprintf(stderr, "metadata: cannot open %s\n", path);
+  }
+
+  return fd;
+
+}
+
+/* Handles one message.  Returns 1 when asked to exit, 0 otherwise.
+ * Doesn't allocate unless it has to fall back to an avahi resolve, see
+ * the DACPD_TEST_ALLOC build below. */
+static int dacpd_handle(monitor_t *mon, player_t *player, const char *msg) {
+
+  srv_t *srv = mon->srv;
+  char srv_name[SRV_NAME_LEN + 1];
+  char active_remote[ACTIVE_REMOTE_LEN + 1];
+  char cmd[48];
+  int val;
+
+  /* Shutdown message */
+  if (!strcmp(msg, "exit")) {
+    return 1;
+  /* Play/pause toggle becomes absolute when we know what's going on */
+  } else if (!strcmp(msg, "playpause") && (player->playing >= 0)) {
+    srv_cmd(mon, srv, player->playing ? "pause" : "play");
+  /* Volume steps from the volume the client has.  Presses come faster
+   * than the pvol echo, so take the new value right away and let the
+   * metadata correct it. */
+  } else if ((!strcmp(msg, "volumeup") || !strcmp(msg, "volumedown")) && (player->volume >= 0)) {
+    val = player->volume + (!strcmp(msg, "volumeup") ? VOLUME_STEP : -VOLUME_STEP);
+    if (val > 100) val = 100;
+    if (val < 0)   val = 0;
+    snprintf(cmd, sizeof(cmd), "setproperty?dmcp.volume=%d", val);
+    if (srv_cmd(mon, srv, cmd) == 0)
+      player_set_volume(player, val, player->muted);
+  /* Messages from UI (playback controls) */
+  } else if (
+    (!strcmp(msg, "volumeup"))   ||
+    (!strcmp(msg, "volumedown")) ||
+    (!strcmp(msg, "mutetoggle")) ||
+    (!strcmp(msg, "nextitem"))   ||
+    (!strcmp(msg, "previtem"))   ||
+    (!strcmp(msg, "playpause"))  ){
+      if ((srv_cmd(mon, srv, msg) == 0) && !strcmp(msg, "mutetoggle") && (player->muted >= 0))
+        player_set_volume(player, player->volume, !player->muted);
+  /* Messages from UI that already applied volume/mute to the local mixer,
+   * bring the phone in line with it */
+  } else if ((sscanf(msg, "volume,%d", &val) == 1) && (val >= 0) && (val <= 100)) {
+    snprintf(cmd, sizeof(cmd), "setproperty?dmcp.volume=%d", val);
+    if (srv_cmd(mon, srv, cmd) == 0)
+      player_set_volume(player, val, player->muted);
+  /* DACP has no absolute mute, only toggle when the client differs.  A
+   * toggle on an unknown state could just as well invert it. */
+  } else if ((sscanf(msg, "mute,%d", &val) == 1) && ((val == 0) || (val == 1))) {
+    if (player->muted < 0) {
+      fprintf(stderr, "mute,%d ignored, client mute state unknown\n", val);
+    } else if ((val != player->muted) && (srv_cmd(mon, srv, "mutetoggle") == 0)) {
+      player_set_volume(player, player->volume, val);
+    }
+  /* Messages from shairport (DACP sessions) */
+  } else if (!strcmp(msg, "dacp_close")) {
+    monitor_lock(mon);
+    srv_reset(srv);
+    monitor_unlock(mon);
+    player->playing = -1;
+    player->volume = -1;
+    player->muted = -1;
+    notify_post(mon->notify, "dacp_close");
+  } else if (dacp_parse_open(msg, srv_name, active_remote)) {
+    srv_open(mon, srv, srv_name, active_remote);
+  }
+
+  return 0;
+
+}
+
+#ifndef DACPD_TEST_ALLOC
 /* 
  * All of the UDP server/client communication takes place here (main).
  * The avahi lookup code and dacp client communication is handled above.
  */
 int main(int argc, char *argv[]) {
   
-  srv_t srv = { .host = NULL, .srv_name = NULL, .active_remote = NULL };
-  char msg[256];
+  srv_t srv;
+  monitor_t mon;
+  notify_t notify;
+  player_t player = { .playing = -1, .volume = -1, .muted = -1 };
+  md_parser_t parser;
+  char msg[IPC_BUF_LEN];
+  char buf[512];
+  const char *cache_path = DACPD_CACHE;
+  const char *metadata_path = DACPD_METADATA;
+  int opt;
+
+  srv_reset(&srv);
+
+  while ((opt = getopt(argc, argv, "c:p:")) != -1) {
+    switch (opt) {
+    case 'c':
+      cache_path = optarg;
+      break;
+    case 'p':
+      metadata_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-c cache_file] [-p metadata_pipe]\n", argv[0]);
+      return 1;
+    }
+  }
 
   ipc_srv_t *ipc_srv = ipc_srv_new(DACPD_PORT);
   ipc_cli_t *ipc_cli = ipc_cli_new(GPIOD_PORT);
 
+  notify_start(&notify, ipc_cli);
+  player.notify = &notify;
+  md_parser_init(&parser, player_item, &player);
+  int md_fd = metadata_open(metadata_path);
+  if (md_fd < 0) {
+    fprintf(stderr, "DACPD running without metadata\n");
+  }
+
+  cache_t *cache = cache_open(cache_path);
+  if (cache == NULL) {
+    fprintf(stderr, "DACPD running without endpoint cache\n");
+  }
+
+  if (monitor_start(&mon, &srv, &notify, cache) < 0) {
+    fprintf(stderr, "DACPD running without reachability monitor\n");
+  }
+
   fprintf(stderr, "DACPD listening for messages on port %d\n", DACPD_PORT);
 
+  /* Tell systemd we're up, and keep its watchdog fed from the loop */
+  int wd_msec = ipc_watchdog_msec();
+  g_watchdog = (wd_msec > 0);
+  ipc_notify("READY=1");
+
+  /* A negative fd (no metadata) is ignored by poll */
+  struct pollfd fds[2] = {
+    { .fd = ipc_srv->sockfd, .events = POLLIN },
+    { .fd = md_fd,           .events = POLLIN },
+  };
+
   while(1) {
 
-    ipc_srv_recv(ipc_srv, msg, 256);
+    int rc = poll(fds, 2, wd_msec);
+
+    if (wd_msec > 0) {
+      ipc_notify("WATCHDOG=1");
+    }
+
+    if (rc <= 0) {
+      continue;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      int n = read(md_fd, buf, sizeof(buf));
+      if (n > 0) {
+        md_parser_feed(&parser, buf, n);
+      }
+    }
+
+    if (!(fds[0].revents & POLLIN)) {
+      continue;
+    }
+
+    if (ipc_srv_recv(ipc_srv, msg, sizeof(msg) - 1) != 0) {
+      continue;
+    }
     fprintf(stderr, "msg: %s\n", msg);
 
-    /* Shutdown message */
-    if (!strcmp(msg, "exit")) {
+    if (dacpd_handle(&mon, &player, msg)) {
       break;
-    /* Messages from UI (playback controls) */
-    } else if (
-      (!strcmp(msg, "volumeup"))   ||
-      (!strcmp(msg, "volumedown")) ||
-      (!strcmp(msg, "mutetoggle")) ||
-      (!strcmp(msg, "nextitem"))   ||
-      (!strcmp(msg, "previtem"))   ||
-      (!strcmp(msg, "playpause"))  ){
-        run_dcap_cmd(srv.host, msg, srv.active_remote);
-    /* Messages from shairport (DACP sessions) */
-    } else if (!strcmp(msg, "dacp_close")) {
-      srv_free(&srv);
-      ipc_cli_send(ipc_cli, "dacp_close");
-    } else {
-      size_t n = strlen(msg);
-      char *srv_name = (char *)malloc(n);
-      char *active_remote = (char *)malloc(n);
-      if (sscanf(msg, "dacp_open,%[^,],%[^,]", srv_name, active_remote) == 2) {
-        int n = 10;
-        while (n > 0 && !resolve_itunes_ctrl(&srv, srv_name, active_remote)) {
-          sleep(1);
-          n--;
-        }
-        ipc_cli_send(ipc_cli, "dacp_open");
-      }
-      free(srv_name);
-      free(active_remote);
     }
 
   }
 
+  ipc_notify("STOPPING=1");
+  monitor_stop(&mon);
+  notify_stop(&notify);
+  cache_close(cache);
+  if (md_fd >= 0)
+    close(md_fd);
+
   fprintf(stderr, "DACPD exiting\n");
 
   return 0;
 
 }
+#endif
+
+#ifdef DACPD_TEST_ALLOC
+/*
+ * Verifies the steady state message path never touches the heap.  The
+ * build points DACP_HTTP_CLIENT at true(1) so commands always succeed
+ * without curl; a failing command would legitimately fall back to an
+ * avahi resolve.  A local listener answers the warm start probe.
+ * malloc/calloc/realloc are wrapped to count calls made by this process.
+ *
+ * The reachability monitor is not started (mon.poll is NULL), so the
+ * avahi thread, its callbacks and the locked paths they share with the
+ * main loop are not covered here.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static volatile int g_allocs;
+static volatile int g_counting;
+
+void *malloc(size_t size) {
+  if (g_counting) g_allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  if (g_counting) g_allocs++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  if (g_counting) g_allocs++;
+  return __libc_realloc(p, size);
+}
+
+/* gpiod stand-in, acks the reliable session state messages */
+static void *gpiod_responder(void *ud) {
+  ipc_srv_t *srv = (ipc_srv_t *)ud;
+  char msg[IPC_BUF_LEN];
+  while (1) {
+    ipc_srv_recv(srv, msg, sizeof(msg) - 1);
+  }
+  return NULL;
+}
+
+/* Phone stand-in, only ever sees connect probes */
+static void *responder(void *ud) {
+  int lfd = *(int *)ud;
+  while (1) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  return NULL;
+}
+
+int main(void) {
+
+  /* Phone stand-in */
+  struct sockaddr_in sa;
+  socklen_t salen = sizeof(sa);
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  bind(lfd, (struct sockaddr *)&sa, sizeof(sa));
+  listen(lfd, 8);
+  getsockname(lfd, (struct sockaddr *)&sa, &salen);
+  int http_port = ntohs(sa.sin_port);
+  pthread_t tid;
+  pthread_create(&tid, NULL, responder, &lfd);
+
+  ipc_srv_t *gpiod = ipc_srv_new(0);
+  salen = sizeof(sa);
+  getsockname(gpiod->sockfd, (struct sockaddr *)&sa, &salen);
+  int gpiod_port = ntohs(sa.sin_port);
+  pthread_create(&tid, NULL, gpiod_responder, gpiod);
+
+  /* Seed the endpoint cache so dacp_open takes the warm start path */
+  char path[] = "/tmp/dacpd-alloc-test-XXXXXX";
+  close(mkstemp(path));
+  cache_t *cache = cache_open(path);
+  cache_put(cache, "iTunes_Ctrl_F44ADA81654B1C9", "127.0.0.1", http_port, AF_INET);
+
+  srv_t srv;
+  monitor_t mon;
+  notify_t notify;
+  player_t player = { .playing = -1, .volume = -1, .muted = -1 };
+  md_parser_t parser;
+  srv_reset(&srv);
+  notify_start(&notify, ipc_cli_new(gpiod_port));
+  memset(&mon, 0, sizeof(mon));
+  mon.srv = &srv;
+  mon.notify = &notify;
+  mon.cache = cache;
+  player.notify = &notify;
+  md_parser_init(&parser, player_item, &player);
+
+  /* Metadata as shairport writes it: resume, then pause */
+  const char *md = 
+    "<item><type>73736e63</type><code>7072736d</code><length>0</length></item>\n"
+    "<item><type>73736e63</type><code>70766f6c</code><length>25</length>\n"
+    "<data encoding=\"base64\">\nLTE1LjAwLC0xNS4wMCwtMzAuMDAsMC4wMA==</data></item>\n"
+    "<item><type>73736e63</type><code>70666c73</code><length>0</length></item>\n";
+
+  const char *msgs[] = {
+    "dacp_open,iTunes_Ctrl_F44ADA81654B1C9,1234567890",
+    "volumeup",
+    "volumedown",
+    "playpause",
+    "nextitem",
+    "volume,40",
+    "mute,1",
+    "dacp_close",
+    "dacp_open,iTunes_Ctrl_F44ADA81654B1C9_this_name_is_far_too_long_for_a_dacp_id,1",
+    "bogus",
+  };
+  int n = sizeof(msgs) / sizeof(msgs[0]);
+  int i, j;
+
+  /* Warm up (first system() call, stdio, etc.) */
+  for (j = 0; j < n; j++) {
+    md_parser_feed(&parser, md, strlen(md));
+    dacpd_handle(&mon, &player, msgs[j]);
+  }
+
+  g_counting = 1;
+  for (i = 0; i < 10; i++) {
+    for (j = 0; j < n; j++) {
+      md_parser_feed(&parser, md, strlen(md));
+      dacpd_handle(&mon, &player, msgs[j]);
+    }
+  }
+  notify_flush(&notify);
+  g_counting = 0;
+
+  notify_stop(&notify);
+  cache_close(cache);
+  unlink(path);
+
+  /* Every session state message must have made it to gpiod */
+  unsigned long failures = notify.gpiod->stats[IPC_MODE_RELIABLE].failures;
+
+  fprintf(stderr, "%s: %d heap allocations in %d messages, %lu unacknowledged\n", 
+    (g_allocs || failures) ? "FAIL" : "PASS", g_allocs, 10 * n, failures);
+
+  return (g_allocs || failures) ? 1 : 0;
+
+}
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Benchmark for DACP message parsing and name matching. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Notes:
+ *   Every browse result is matched against the session's service name,
+ *   so the cost of a browse pass grows with the number of DACP services
+ *   on the network (and with the browse cache).  A resolve stops at the
+ *   first match, so this times that search over synthetic result sets of
+ *   increasing size: for names spread evenly through the set (hit, on
+ *   average half a pass) and for a name that isn't there (miss, a full
+ *   pass).  Plus the dacp_open parse.  Run before and after touching
+ *   dacp.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dacp.h"
+
+/* Browse result set sizes to time */
+static const int g_sizes[] = { 16, 256, 4096, 65536 };
+
+/* Each pass runs over roughly this many names in total */
+#define BENCH_NAMES (4 * 1000 * 1000)
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Searches for spread evenly through each result set */
+#define BENCH_TARGETS (64)
+
+/* xorshift64*, rand() only gives 31 bits */
+static unsigned long long g_seed;
+
+static unsigned long long rand64(void) {
+  g_seed ^= g_seed >> 12;
+  g_seed ^= g_seed << 25;
+  g_seed ^= g_seed >> 27;
+  return g_seed * 2685821657736338717ULL;
+}
+
+/* Phones advertise zero padded 64 bit IDs.  Same seed every run so
+ * results are comparable. */
+static char (*names_new(int n))[SRV_NAME_LEN + 1] {
+  char (*names)[SRV_NAME_LEN + 1] = malloc(n * sizeof(*names));
+  int i;
+  g_seed = 88172645463325252ULL;
+  for (i = 0; i < n; i++) {
+    unsigned long long id = rand64();
+    /* A few with leading zeros, like real IDs */
+    if ((i % 16) == 0) {
+      id >>= 12;
+    }
+    snprintf(names[i], SRV_NAME_LEN + 1, "iTunes_Ctrl_%016llX", id);
+  }
+  return names;
+}
+
+/* What a resolve does: match in browse order, stop at the first hit.
+ * Returns its index or -1. */
+static int search(const char *prefix, char (*names)[SRV_NAME_LEN + 1], int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (dacp_name_ismatch(prefix, names[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Times searches cycling through the nt prefixes.  Returns ns per
+ * search, *found counts the searches that hit. */
+static double bench_search(char (*prefixes)[SRV_NAME_LEN + 1], int nt,
+    char (*names)[SRV_NAME_LEN + 1], int n, long *found) {
+
+  int reps = BENCH_NAMES / n;
+  int r;
+
+  if (reps < nt) {
+    reps = nt;
+  }
+
+  *found = 0;
+  double start = now_ns();
+  for (r = 0; r < reps; r++) {
+    *found += (search(prefixes[r % nt], names, n) >= 0);
+  }
+  return (now_ns() - start) / reps;
+
+}
+
+int main(void) {
+
+  char prefixes[BENCH_TARGETS][SRV_NAME_LEN + 1];
+  char miss[1][SRV_NAME_LEN + 1] = { "iTunes_Ctrl_123456789ABCDEF" };
+  char srv_name[SRV_NAME_LEN + 1];
+  char active_remote[ACTIVE_REMOTE_LEN + 1];
+  long found;
+  int s, t;
+
+  printf("%8s %16s %16s\n", "names", "hit ns/search", "miss ns/search");
+
+  for (s = 0; s < (int)(sizeof(g_sizes) / sizeof(g_sizes[0])); s++) {
+
+    int n = g_sizes[s];
+    char (*names)[SRV_NAME_LEN + 1] = names_new(n);
+
+    /* Wanted sessions spread through the set, as shairport reports them
+     * (leading zeros dropped) */
+    int nt = (n < BENCH_TARGETS) ? n : BENCH_TARGETS;
+    for (t = 0; t < nt; t++) {
+      unsigned long long id;
+      sscanf(names[(long)t * n / nt], "iTunes_Ctrl_%llX", &id);
+      snprintf(prefixes[t], sizeof(prefixes[t]), "iTunes_Ctrl_%llX", id);
+    }
+    double hit = bench_search(prefixes, nt, names, n, &found);
+    if (found == 0) {
+      fprintf(stderr, "FAIL: %s not found\n", prefixes[0]);
+      return 1;
+    }
+
+    double all = bench_search(miss, 1, names, n, &found);
+
+    printf("%8d %16.1f %16.1f\n", n, hit, all);
+    free(names);
+
+  }
+
+  /* dacp_open parse */
+  const char *msg = "dacp_open,iTunes_Ctrl_0F44ADA81654B1C9,1986535575";
+  int i, ok = 0;
+  double start = now_ns();
+  for (i = 0; i < BENCH_NAMES / 4; i++) {
+    ok += dacp_parse_open(msg, srv_name, active_remote);
+  }
+  printf("dacp_open parse: %.1f ns/msg (%d)\n", (now_ns() - start) / (BENCH_NAMES / 4), ok > 0);
+
+  return 0;
+
+}
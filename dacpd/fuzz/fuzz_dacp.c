@@ -0,0 +1,191 @@
+/*
+ * Fuzz target for DACP message parsing and name matching. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Notes:
+ *   The whole input is handed to dacp_parse_open() as a message.  If it
+ *   contains a newline, the part before is also used as a match prefix
+ *   and the rest as a browsed service name, and dacp_name_ismatch() is
+ *   checked against a simple reference that strips the zeros with a
+ *   copy.  Built for libFuzzer by default, or with -DFUZZ_STANDALONE for
+ *   AFL and corpus replay (see Makefile).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dacp.h"
+
+/* Drops the zeros right after each '_', then compares the prefix */
+static int ref_ismatch(const char *prefix, const char *name) {
+
+  char *stripped = malloc(strlen(name) + 1);
+  char *p = stripped;
+  int skip = 0;
+
+  for (; *name != '\0'; name++) {
+    if (skip && (*name == '0')) {
+      continue;
+    }
+    skip = (*name == '_');
+    *p++ = *name;
+  }
+  *p = '\0';
+
+  int rc = !strncmp(stripped, prefix, strlen(prefix));
+  free(stripped);
+  return rc;
+
+}
+
+/* Exactly sized so ASan catches a single byte too many */
+static void check_open(const char *msg) {
+
+  char *srv_name = malloc(SRV_NAME_LEN + 1);
+  char *active_remote = malloc(ACTIVE_REMOTE_LEN + 1);
+
+  if (dacp_parse_open(msg, srv_name, active_remote)) {
+
+    size_t n = strlen(srv_name);
+    size_t r = strlen(active_remote);
+
+    /* Fields must be exactly what is in the message, not truncated */
+    if (n == 0 || n > SRV_NAME_LEN || r == 0 || r > ACTIVE_REMOTE_LEN ||
+        strncmp(msg, "dacp_open,", 10) ||
+        strncmp(msg + 10, srv_name, n) || msg[10 + n] != ',' ||
+        strncmp(msg + 11 + n, active_remote, r) ||
+        (msg[11 + n + r] != '\0' && msg[11 + n + r] != ',')) {
+      fprintf(stderr, "bad parse of '%s': '%s' '%s'\n", msg, srv_name, active_remote);
+      abort();
+    }
+
+    /* Nothing that could break out of the quoted shell arguments */
+    if ((strspn(srv_name, DACP_NAME_CHARS) != n) ||
+        (strspn(active_remote, DACP_REMOTE_CHARS) != r)) {
+      fprintf(stderr, "unsafe fields accepted from '%s': '%s' '%s'\n", msg, srv_name, active_remote);
+      abort();
+    }
+
+  }
+
+  free(srv_name);
+  free(active_remote);
+
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+
+  char *msg = malloc(size + 1);
+  memcpy(msg, data, size);
+  msg[size] = '\0';
+
+  check_open(msg);
+
+  char *nl = strchr(msg, '\n');
+  if (nl != NULL) {
+    *nl = '\0';
+    if (dacp_name_ismatch(msg, nl + 1) != ref_ismatch(msg, nl + 1)) {
+      fprintf(stderr, "match mismatch: '%s' '%s'\n", msg, nl + 1);
+      abort();
+    }
+  }
+
+  free(msg);
+  return 0;
+
+}
+
+#ifdef FUZZ_STANDALONE
+#include <dirent.h>
+#include <sys/stat.h>
+
+static int run_file(const char *path) {
+
+  static uint8_t buf[65536];
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return -1;
+  }
+  size_t n = fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+
+  LLVMFuzzerTestOneInput(buf, n);
+  return 0;
+
+}
+
+/* Runs each file given (AFL passes one via @@), descending into
+ * directories.  With no arguments, replays $srcdir/fuzz/corpus. */
+int main(int argc, char *argv[]) {
+
+  const char *srcdir = getenv("srcdir") ? getenv("srcdir") : ".";
+  char corpus[256];
+  int runs = 0;
+  int i;
+
+  if (argc < 2) {
+    snprintf(corpus, sizeof(corpus), "%s/fuzz/corpus", srcdir);
+    argv[0] = corpus;
+    argc = 1;
+  } else {
+    argv++;
+    argc--;
+  }
+
+  for (i = 0; i < argc; i++) {
+
+    struct stat st;
+    if (stat(argv[i], &st) < 0) {
+      fprintf(stderr, "Cannot stat %s\n", argv[i]);
+      return 1;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+      runs += (run_file(argv[i]) == 0);
+      continue;
+    }
+
+    DIR *dir = opendir(argv[i]);
+    struct dirent *de;
+    while (dir && (de = readdir(dir)) != NULL) {
+      char path[512];
+      if (de->d_name[0] == '.') {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", argv[i], de->d_name);
+      runs += (run_file(path) == 0);
+    }
+    if (dir) {
+      closedir(dir);
+    }
+
+  }
+
+  fprintf(stderr, "%s: %d inputs\n", runs ? "PASS" : "FAIL", runs);
+  return runs ? 0 : 1;
+
+}
+#endif
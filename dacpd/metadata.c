@@ -0,0 +1,273 @@
+/*
+ * Shairport metadata pipe parser. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "metadata.h"
+
+enum {
+  ELEM_NONE,
+  ELEM_TYPE,
+  ELEM_CODE,
+  ELEM_LENGTH,
+  ELEM_DATA,
+};
+
+void md_parser_init(md_parser_t *p, md_item_cb cb, void *ud) {
+  memset(p, 0, sizeof(md_parser_t));
+  p->cb = cb;
+  p->ud = ud;
+}
+
+static int b64_value(char c) {
+  if ((c >= 'A') && (c <= 'Z')) return c - 'A';
+  if ((c >= 'a') && (c <= 'z')) return c - 'a' + 26;
+  if ((c >= '0') && (c <= '9')) return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+static void md_data_byte(md_parser_t *p, uint32_t b) {
+  if (p->data_len < MD_DATA_MAX) {
+    p->data[p->data_len++] = (char)(b & 0xff);
+  }
+}
+
+/* Decodes base64 as it arrives, four characters at a time */
+static void md_b64(md_parser_t *p, char c) {
+
+  int v = b64_value(c);
+
+  /* Line breaks, padding, etc. */
+  if (v < 0) {
+    return;
+  }
+
+  p->quad = (p->quad << 6) | v;
+  p->quad_n++;
+
+  if (p->quad_n == 4) {
+    md_data_byte(p, p->quad >> 16);
+    md_data_byte(p, p->quad >> 8);
+    md_data_byte(p, p->quad);
+    p->quad = 0;
+    p->quad_n = 0;
+  }
+
+}
+
+/* Leftovers of a padded final quad */
+static void md_b64_flush(md_parser_t *p) {
+
+  if (p->quad_n == 2) {
+    md_data_byte(p, p->quad >> 4);
+  } else if (p->quad_n == 3) {
+    md_data_byte(p, p->quad >> 10);
+    md_data_byte(p, p->quad >> 2);
+  }
+
+  p->quad = 0;
+  p->quad_n = 0;
+
+}
+
+static void md_text(md_parser_t *p, char c) {
+
+  switch (p->elem) {
+  case ELEM_TYPE:
+  case ELEM_CODE:
+  case ELEM_LENGTH:
+    if (p->text_len < (int)sizeof(p->text) - 1) {
+      p->text[p->text_len++] = c;
+    }
+    break;
+
+  case ELEM_DATA:
+    if (!p->skip) {
+      md_b64(p, c);
+    }
+    break;
+  }
+
+}
+
+static void md_start_text(md_parser_t *p, int elem) {
+  p->elem = elem;
+  p->text_len = 0;
+}
+
+static char *md_end_text(md_parser_t *p) {
+  p->elem = ELEM_NONE;
+  p->text[p->text_len] = '\0';
+  return p->text;
+}
+
+/* A complete tag (without the brackets) has been read */
+static void md_tag(md_parser_t *p) {
+
+  char *tag = p->tag;
+  tag[p->tag_len] = '\0';
+
+  if (!strcmp(tag, "item")) {
+    p->type = 0;
+    p->code = 0;
+    p->length = 0;
+    p->skip = 0;
+    p->data_len = 0;
+    p->elem = ELEM_NONE;
+  } else if (!strcmp(tag, "type")) {
+    md_start_text(p, ELEM_TYPE);
+  } else if (!strcmp(tag, "code")) {
+    md_start_text(p, ELEM_CODE);
+  } else if (!strcmp(tag, "length")) {
+    md_start_text(p, ELEM_LENGTH);
+  } else if (!strncmp(tag, "data", 4) && ((tag[4] == ' ') || (tag[4] == '\0'))) {
+    p->elem = ELEM_DATA;
+    p->data_len = 0;
+    p->quad = 0;
+    p->quad_n = 0;
+    p->skip = (p->length > MD_DATA_MAX) || (p->code == MD_CODE('P','I','C','T'));
+  } else if (!strcmp(tag, "/type")) {
+    p->type = strtoul(md_end_text(p), NULL, 16);
+  } else if (!strcmp(tag, "/code")) {
+    p->code = strtoul(md_end_text(p), NULL, 16);
+  } else if (!strcmp(tag, "/length")) {
+    p->length = atoi(md_end_text(p));
+  } else if (!strcmp(tag, "/data")) {
+    if (!p->skip) {
+      md_b64_flush(p);
+    }
+    p->elem = ELEM_NONE;
+  } else if (!strcmp(tag, "/item")) {
+    p->data[p->data_len] = '\0';
+    if (p->cb) {
+      p->cb(p->type, p->code, p->skip ? NULL : p->data, p->skip ? p->length : p->data_len, p->ud);
+    }
+    p->elem = ELEM_NONE;
+  } else {
+    p->elem = ELEM_NONE;
+  }
+
+}
+
+void md_parser_feed(md_parser_t *p, const char *buf, int n) {
+
+  int i;
+  for (i = 0; i < n; i++) {
+    char c = buf[i];
+    if (p->in_tag) {
+      if (c == '>') {
+        p->in_tag = 0;
+        md_tag(p);
+      } else if (p->tag_len < (int)sizeof(p->tag) - 1) {
+        p->tag[p->tag_len++] = c;
+      }
+    } else if (c == '<') {
+      p->in_tag = 1;
+      p->tag_len = 0;
+    } else {
+      md_text(p, c);
+    }
+  }
+
+}
+
+#ifdef METADATA_TEST
+/*
+ * Replays a recorded pipe fixture through the parser, split into chunks
+ * of various sizes, and compares the items against the expected output.
+ * With no arguments the fixture in $srcdir/fixtures is used (make check).
+ */
+static char g_out[16384];
+static int g_out_len;
+
+static void test_item(uint32_t type, uint32_t code, const char *data, int len, void *ud) {
+  g_out_len += snprintf(g_out + g_out_len, sizeof(g_out) - g_out_len, 
+    "%c%c%c%c %c%c%c%c %d %s\n",
+    (type >> 24) & 0xff, (type >> 16) & 0xff, (type >> 8) & 0xff, type & 0xff,
+    (code >> 24) & 0xff, (code >> 16) & 0xff, (code >> 8) & 0xff, code & 0xff,
+    len, data ? data : "(skipped)");
+}
+
+static int read_file(const char *path, char *buf, int max) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    exit(1);
+  }
+  int n = fread(buf, 1, max - 1, f);
+  buf[n] = '\0';
+  fclose(f);
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+
+  static char fixture[65536];
+  static char expected[16384];
+  char fixture_path[256];
+  char expected_path[256];
+  const char *srcdir = getenv("srcdir") ? getenv("srcdir") : ".";
+
+  if (argc > 2) {
+    snprintf(fixture_path, sizeof(fixture_path), "%s", argv[1]);
+    snprintf(expected_path, sizeof(expected_path), "%s", argv[2]);
+  } else {
+    snprintf(fixture_path, sizeof(fixture_path), "%s/fixtures/metadata.xml", srcdir);
+    snprintf(expected_path, sizeof(expected_path), "%s/fixtures/metadata.expected", srcdir);
+  }
+
+  int n = read_file(fixture_path, fixture, sizeof(fixture));
+  read_file(expected_path, expected, sizeof(expected));
+
+  const int chunks[] = { 1, 2, 3, 7, 64, 1000, 65536 };
+  int fails = 0;
+  int c;
+
+  for (c = 0; c < (int)(sizeof(chunks) / sizeof(chunks[0])); c++) {
+    md_parser_t p;
+    md_parser_init(&p, test_item, NULL);
+    g_out_len = 0;
+    g_out[0] = '\0';
+
+    int i;
+    for (i = 0; i < n; i += chunks[c]) {
+      md_parser_feed(&p, fixture + i, (n - i < chunks[c]) ? n - i : chunks[c]);
+    }
+
+    if (strcmp(g_out, expected)) {
+      fprintf(stderr, "FAIL: chunk size %d\n--- got\n%s--- expected\n%s", chunks[c], g_out, expected);
+      fails++;
+    }
+  }
+
+  fprintf(stderr, "%s: %s\n", fails ? "FAIL" : "PASS", fixture_path);
+  return fails ? 1 : 0;
+
+}
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Shairport metadata pipe parser. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Notes:
+ *   shairport-sync (built --with-metadata) writes a stream of items to
+ *   a named pipe, each looking like this:
+ *
+ *     <item><type>73736e63</type><code>70766f6c</code><length>28</length>
+ *     <data encoding="base64">
+ *     LTIxLjg3LC0yMS44NywtMzAuMDAsMC4wMA==</data></item>
+ *
+ *   type and code are four character codes in hex ('ssnc', 'pvol').
+ *   The parser is fed whatever read() returns and hands complete items
+ *   to a callback.  Memory use is fixed: payloads larger than
+ *   MD_DATA_MAX (and cover art, regardless of size) are consumed
+ *   without being stored.
+ */
+
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stdint.h>
+
+/* Largest payload we keep (track names, volume, etc.) */
+#define MD_DATA_MAX (1024)
+
+/* Four character code, e.g. MD_CODE('s','s','n','c') */
+#define MD_CODE(a, b, c, d) \
+  (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+/* Item callback.  data is NUL terminated, or NULL if the payload was
+ * skipped (too large or artwork), len is the payload length either way */
+typedef void (*md_item_cb)(uint32_t type, uint32_t code, const char *data, int len, void *ud);
+
+typedef struct {
+  int in_tag;               /* Between '<' and '>' */
+  int elem;                 /* Element whose text we are reading */
+  char tag[32];             /* Current tag (truncated) */
+  int tag_len;
+  char text[16];            /* type/code/length text */
+  int text_len;
+
+  uint32_t type;            /* Item being assembled */
+  uint32_t code;
+  int length;
+  int skip;
+  char data[MD_DATA_MAX + 1];
+  int data_len;
+
+  uint32_t quad;            /* base64 decoder state */
+  int quad_n;
+
+  md_item_cb cb;
+  void *ud;
+} md_parser_t;
+
+/* Resets the parser and sets the item callback */
+void md_parser_init(md_parser_t *p, md_item_cb cb, void *ud);
+
+/* Feeds the next n bytes of the stream (any split is fine) */
+void md_parser_feed(md_parser_t *p, const char *buf, int n);
+
+#endif /* METADATA_H */
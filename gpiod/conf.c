@@ -0,0 +1,327 @@
+/*
+ * Button/LED configuration. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "conf.h"
+
+/* Original console wiring */
+static const struct {
+  int gpio;
+  const char *cmd;
+} g_default_buttons[] = {
+  { 13, "volumeup"   },
+  { 26, "volumedown" },
+  {  6, "mutetoggle" },
+  { 12, "nextitem"   },
+  {  5, "previtem"   },
+  { 16, "playpause"  },
+};
+
+static const conf_led_t g_default_leds[] = {
+  { 24, CONF_LED_READY  },
+  { 23, CONF_LED_ACTIVE },
+};
+
+void conf_defaults(conf_t *conf) {
+
+  int i;
+
+  memset(conf, 0, sizeof(*conf));
+
+  for (i = 0; i < (int)(sizeof(g_default_buttons) / sizeof(g_default_buttons[0])); i++) {
+    conf_button_t *b = &conf->buttons[conf->nbuttons++];
+    b->gpio = g_default_buttons[i].gpio;
+    b->edge = CONF_EDGE_FALLING;
+    b->debounce_ms = CONF_DEBOUNCE_MS;
+    snprintf(b->cmd, sizeof(b->cmd), "%s", g_default_buttons[i].cmd);
+  }
+
+  for (i = 0; i < (int)(sizeof(g_default_leds) / sizeof(g_default_leds[0])); i++) {
+    conf->leds[conf->nleds++] = g_default_leds[i];
+  }
+
+}
+
+/* Parses a non-negative decimal number, -1 if it isn't one */
+static int parse_num(const char *s) {
+  char *end;
+  long v;
+  if (*s < '0' || *s > '9') {
+    return -1;
+  }
+  v = strtol(s, &end, 10);
+  if (*end != '\0' || v > 60000) {
+    return -1;
+  }
+  return (int)v;
+}
+
+/* Parses a GPIO number and makes sure nothing else already claimed it */
+static int parse_gpio(const char *s, const char *used) {
+  int gpio = parse_num(s);
+  if (gpio < 0 || gpio >= CONF_PINS || used[gpio]) {
+    return -1;
+  }
+  return gpio;
+}
+
+/* button <gpio> <command> [options] */
+static const char *parse_button(conf_t *conf, char *used, char **save) {
+
+  conf_button_t *b;
+  char *tok;
+
+  if (conf->nbuttons >= CONF_PINS) {
+    return "too many buttons";
+  }
+  b = &conf->buttons[conf->nbuttons];
+  b->edge = CONF_EDGE_FALLING;
+  b->debounce_ms = CONF_DEBOUNCE_MS;
+
+  if ((tok = strtok_r(NULL, " \t", save)) == NULL || (b->gpio = parse_gpio(tok, used)) < 0) {
+    return "bad or duplicate gpio";
+  }
+  if ((tok = strtok_r(NULL, " \t", save)) == NULL || strlen(tok) >= CONF_CMD_LEN) {
+    return "missing or overlong command";
+  }
+  strcpy(b->cmd, tok);
+
+  while ((tok = strtok_r(NULL, " \t", save)) != NULL) {
+    if (!strcmp(tok, "edge=falling")) {
+      b->edge = CONF_EDGE_FALLING;
+    } else if (!strcmp(tok, "edge=rising")) {
+      b->edge = CONF_EDGE_RISING;
+    } else if (!strcmp(tok, "edge=both")) {
+      b->edge = CONF_EDGE_BOTH;
+    } else if (!strncmp(tok, "debounce=", 9)) {
+      if ((b->debounce_ms = parse_num(tok + 9)) < 0) {
+        return "bad debounce";
+      }
+    } else if (!strncmp(tok, "repeat=", 7)) {
+      char *comma = strchr(tok + 7, ',');
+      if (comma == NULL) {
+        return "repeat needs <delay_ms>,<interval_ms>";
+      }
+      *comma = '\0';
+      b->repeat_delay_ms = parse_num(tok + 7);
+      b->repeat_ms = parse_num(comma + 1);
+      if (b->repeat_delay_ms <= 0 || b->repeat_ms <= 0) {
+        return "bad repeat";
+      }
+    } else {
+      return "unknown button option";
+    }
+  }
+
+  /* Held means the pin stays low after a press */
+  if (b->repeat_delay_ms && b->edge != CONF_EDGE_FALLING) {
+    return "repeat needs edge=falling";
+  }
+
+  used[b->gpio] = 1;
+  conf->nbuttons++;
+  return NULL;
+
+}
+
+/* led <gpio> <role> */
+static const char *parse_led(conf_t *conf, char *used, char **save) {
+
+  conf_led_t *led;
+  char *tok;
+
+  if (conf->nleds >= CONF_LEDS) {
+    return "too many LEDs";
+  }
+  led = &conf->leds[conf->nleds];
+
+  if ((tok = strtok_r(NULL, " \t", save)) == NULL || (led->gpio = parse_gpio(tok, used)) < 0) {
+    return "bad or duplicate gpio";
+  }
+  if ((tok = strtok_r(NULL, " \t", save)) == NULL) {
+    return "missing role";
+  } else if (!strcmp(tok, "ready")) {
+    led->role = CONF_LED_READY;
+  } else if (!strcmp(tok, "active")) {
+    led->role = CONF_LED_ACTIVE;
+  } else if (!strcmp(tok, "muted")) {
+    led->role = CONF_LED_MUTED;
+  } else {
+    return "unknown role";
+  }
+  if (strtok_r(NULL, " \t", save) != NULL) {
+    return "trailing junk";
+  }
+
+  used[led->gpio] = 1;
+  conf->nleds++;
+  return NULL;
+
+}
+
+int conf_load(conf_t *conf, const char *path) {
+
+  conf_t tmp;
+  char used[CONF_PINS];
+  char line[256];
+  int lineno = 0;
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    int err = errno;
+    fprintf(stderr, "ERROR: Cannot open %s: %s\n", path, strerror(err));
+    errno = err;
+    return -1;
+  }
+
+  memset(&tmp, 0, sizeof(tmp));
+  memset(used, 0, sizeof(used));
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+
+    const char *err = NULL;
+    char *save;
+    char *tok;
+
+    lineno++;
+
+    if (strchr(line, '\n') == NULL && !feof(fp)) {
+      err = "line too long";
+      goto bad;
+    }
+    line[strcspn(line, "#\r\n")] = '\0';
+
+    if ((tok = strtok_r(line, " \t", &save)) == NULL) {
+      continue;
+    } else if (!strcmp(tok, "button")) {
+      err = parse_button(&tmp, used, &save);
+    } else if (!strcmp(tok, "led")) {
+      err = parse_led(&tmp, used, &save);
+    } else {
+      err = "unknown keyword";
+    }
+
+bad:
+    if (err != NULL) {
+      fprintf(stderr, "ERROR: %s:%d: %s\n", path, lineno, err);
+      fclose(fp);
+      return -1;
+    }
+
+  }
+
+  fclose(fp);
+  *conf = tmp;
+  return 0;
+
+}
+
+#ifdef CONF_TEST
+#include <unistd.h>
+
+/*
+ * The shipped gpiod.conf must describe exactly the built-in wiring, and
+ * broken files must be rejected without touching the current config.
+ */
+static int load_string(conf_t *conf, const char *text) {
+  char path[] = "/tmp/conf-test-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *fp = fdopen(fd, "w");
+  fputs(text, fp);
+  fclose(fp);
+  int rc = conf_load(conf, path);
+  unlink(path);
+  return rc;
+}
+
+int main(int argc, char *argv[]) {
+
+  const char *srcdir = getenv("srcdir") ? getenv("srcdir") : ".";
+  char path[256];
+  conf_t defaults, conf;
+  int fails = 0;
+  int i;
+
+  snprintf(path, sizeof(path), "%s/gpiod.conf", (argc > 1) ? argv[1] : srcdir);
+
+  conf_defaults(&defaults);
+  memset(&conf, 0, sizeof(conf));
+  if (conf_load(&conf, path) < 0 || memcmp(&conf, &defaults, sizeof(conf))) {
+    fprintf(stderr, "FAIL: %s does not match the built-in defaults\n", path);
+    fails++;
+  }
+
+  const char *bad[] = {
+    "button 13\n",
+    "button 28 playpause\n",
+    "button 13 playpause\nbutton 13 nextitem\n",
+    "button 13 playpause\nled 13 ready\n",
+    "button 13 waytoolongcommandnamethatdoesnotfit\n",
+    "button 13 playpause edge=sideways\n",
+    "button 13 playpause debounce=-5\n",
+    "button 13 playpause repeat=500\n",
+    "button 13 playpause edge=both repeat=500,100\n",
+    "button 13 playpause edge=rising repeat=500,100\n",
+    "led 24 blue\n",
+    "led 24 ready extra\n",
+    "switch 13 playpause\n",
+  };
+
+  for (i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+    conf = defaults;
+    if (load_string(&conf, bad[i]) == 0 || memcmp(&conf, &defaults, sizeof(conf))) {
+      fprintf(stderr, "FAIL: accepted: %s", bad[i]);
+      fails++;
+    }
+  }
+
+  /* Options, comments and blank lines */
+  if (load_string(&conf, 
+      "# comment\n\n"
+      "  button 17 volumeup debounce=50 repeat=400,120  # hold\n"
+      "button 18 playpause\tedge=rising\n"
+      "led 4 active\n"
+      "led 7 muted\n") < 0 ||
+      conf.nbuttons != 2 || conf.nleds != 2 ||
+      conf.buttons[0].gpio != 17 || strcmp(conf.buttons[0].cmd, "volumeup") ||
+      conf.buttons[0].edge != CONF_EDGE_FALLING || conf.buttons[0].debounce_ms != 50 ||
+      conf.buttons[0].repeat_delay_ms != 400 || conf.buttons[0].repeat_ms != 120 ||
+      conf.buttons[1].gpio != 18 || conf.buttons[1].edge != CONF_EDGE_RISING ||
+      conf.buttons[1].debounce_ms != CONF_DEBOUNCE_MS || conf.buttons[1].repeat_delay_ms != 0 ||
+      conf.leds[0].gpio != 4 || conf.leds[0].role != CONF_LED_ACTIVE ||
+      conf.leds[1].gpio != 7 || conf.leds[1].role != CONF_LED_MUTED) {
+    fprintf(stderr, "FAIL: options not parsed\n");
+    fails++;
+  }
+
+  fprintf(stderr, "%s: %d failures\n", fails ? "FAIL" : "PASS", fails);
+  return fails ? 1 : 0;
+
+}
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Button/LED configuration. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Notes:
+ *   The console wiring (which GPIO does what) used to be compiled in.
+ *   It now comes from a small line based file so controls can be added
+ *   or moved without a rebuild.  Parsing is kept apart from the GPIO
+ *   side so it can be checked on any box (make check).
+ *
+ *   Syntax, one entry per line, '#' starts a comment:
+ *
+ *     button <gpio> <command> [edge=falling|rising|both] [debounce=<ms>]
+ *                             [repeat=<delay_ms>,<interval_ms>]
+ *     led <gpio> ready|active|muted
+ *
+ *   GPIO numbers use the BCM scheme.  See gpiod.conf for the defaults.
+ */
+
+#ifndef CONF_H
+#define CONF_H
+
+/* BCM GPIO 0-27 on the 40 pin header */
+#define CONF_PINS (28)
+
+/* Most LEDs one config can drive */
+#define CONF_LEDS (8)
+
+/* Longest command, including the terminator */
+#define CONF_CMD_LEN (32)
+
+/* Button defaults */
+#define CONF_DEBOUNCE_MS (250)
+
+/* Default config location */
+#define CONF_PATH "/etc/funke-machine/gpiod.conf"
+
+/* Which transitions send the command.  Buttons pull up, so pressing
+ * gives a falling edge and releasing a rising one. */
+#define CONF_EDGE_FALLING (0)
+#define CONF_EDGE_RISING  (1)
+#define CONF_EDGE_BOTH    (2)
+
+/* LED roles, see the state table in README.md */
+#define CONF_LED_READY  (0)   /* White on the original console */
+#define CONF_LED_ACTIVE (1)   /* Green on the original console */
+#define CONF_LED_MUTED  (2)   /* On while the client is muted */
+
+typedef struct {
+  int gpio;
+  int edge;               /* CONF_EDGE_* */
+  int debounce_ms;        /* Ignore edges closer together than this */
+  int repeat_delay_ms;    /* Hold time before repeating, 0=no repeat */
+  int repeat_ms;          /* Interval between repeats while held */
+  char cmd[CONF_CMD_LEN]; /* Message sent to the DACP daemon */
+} conf_button_t;
+
+typedef struct {
+  int gpio;
+  int role;               /* CONF_LED_* */
+} conf_led_t;
+
+typedef struct {
+  int nbuttons;
+  conf_button_t buttons[CONF_PINS];
+  int nleds;
+  conf_led_t leds[CONF_LEDS];
+} conf_t;
+
+/* Fills conf with the original console wiring */
+void conf_defaults(conf_t *conf);
+
+/* Parses the file at path into conf.  On any error conf is left
+ * untouched and -1 is returned (errno is kept for a missing file) */
+int conf_load(conf_t *conf, const char *path);
+
+#endif /* CONF_H */
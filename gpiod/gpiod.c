@@ -23,67 +23,170 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
-//#include <poll.h> 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h> 
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <wiringPi.h>
 #include <time.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
 
 #include "ipc.h"
+#include "conf.h"
+#ifdef HAVE_ALSA
+#include "mixer.h"
+#endif
 
 /* DACP/GPIO Daemon Ports */
 #define DACPD_PORT (3391)
 #define GPIOD_PORT (3392)
 
-/* By default, suppress anything under X ms */
-#define DEBOUNCE_NSEC (250*1000*1000)
+/* Volume change per button press (percent) when using the local mixer */
+#define VOLUME_STEP (5)
 
 /* DACPD comm channel pointer (global) */
 static ipc_cli_t *g_dacpd;
 
-/* Button ISR callback signature */
-typedef void (*button_isr)(void);
+#ifdef HAVE_ALSA
+/* Local mixer, NULL unless enabled with -m (global) */
+static mixer_t *g_mixer;
+#endif
 
-/* Single button data structure */
+/* Runtime state of a single GPIO, kept across config reloads */
 typedef struct {
-  int id;               /* GPIO number */
-  char cmd[32];         /* Associated DACP command */
+  int armed;            /* ISR registered (stays registered for good) */
+  int button;           /* Index into g_conf.buttons, -1=not a button */
   struct timespec time; /* Time of last recorded event */
-  button_isr isr;       /* ISR callback */
-} button_t;
+} pin_t;
 
-/* Group of all buttons */
-typedef struct {
-  button_t *vup;
-  button_t *vdown;
-  button_t *mute;
-  button_t *next;
-  button_t *prev;
-  button_t *pause;
-} buttons_t;
-
-/* Buttons (global) */
-static buttons_t g_buttons;
-
-/* LED */
-typedef struct {
-  int id;           /* GPIO number */
-  char color[32];   /* Color (green/white/etc) */
-  int status;       /* 0=OFF, 1=ON */
-} led_t;
+/* Active button/LED mapping and per GPIO state (global).  The ISR
+ * threads only read the table, under g_conf_lock; the main thread is
+ * the only writer. */
+static conf_t g_conf;
+static pin_t g_pins[CONF_PINS];
+static unsigned g_conf_gen;
+static pthread_mutex_t g_conf_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* AirPlay state as reported by the DACP daemon */
 typedef struct {
-  led_t *white;
-  led_t *green;
-} leds_t;
+  int session;      /* 0=none, 1=open */
+  int reachable;    /* Client can be reached via DACP */
+  int playing;      /* -1=unknown, 0=paused, 1=playing */
+  int muted;        /* -1=unknown, 0=no, 1=yes */
+} state_t;
+
+/* Paused blinks the active LED, on and off for this long each */
+#define BLINK_MSEC (500)
+
+/* Current blink phase, toggled from the main loop (global) */
+static int g_blink_on;
+
+/* State (global) */
+static state_t g_state = { .session = 0, .reachable = 0, .playing = -1, .muted = -1 };
+
+/* Paused is the only state that blinks */
+static int leds_blinking(void) {
+  return g_state.session && g_state.reachable && (g_state.playing == 0);
+}
+
+/* Monotonic time in ms, for the blink */
+static long long now_msec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Drives the LEDs from the current state */
+static void leds_update(void) {
+
+  int ready, active;
+  int i;
+
+  if (!g_state.session) {
+    ready = 1; active = 0;   /* Ready */
+  } else if (!g_state.reachable) {
+    ready = 1; active = 1;   /* Session, but client unreachable */
+  } else if (g_state.playing == 0) {
+    ready = 0; active = g_blink_on;   /* Session, paused */
+  } else {
+    ready = 0; active = 1;   /* Session, playing */
+  }
 
-/* LEDs (global) */
-static leds_t g_leds;
+  for (i = 0; i < g_conf.nleds; i++) {
+    switch (g_conf.leds[i].role) {
+    case CONF_LED_READY:
+      digitalWrite(g_conf.leds[i].gpio, ready);
+      break;
+    case CONF_LED_ACTIVE:
+      digitalWrite(g_conf.leds[i].gpio, active);
+      break;
+    case CONF_LED_MUTED:
+      digitalWrite(g_conf.leds[i].gpio, g_state.muted == 1);
+      break;
+    }
+  }
+
+}
+
+#ifdef HAVE_ALSA
+/* Applies volume/mute straight to the local mixer, then lets the DACP
+ * daemon tell the phone about it (fire and forget, nothing waits on the
+ * phone).  Returns 1 if handled, 0 to fall back to plain DACP. */
+static int mixer_cmd(const char *cmd) {
 
-/* Debounces button press events */
-static void debounce(button_t *button) {
+  char msg[32];
+  int val, unmuted;
+
+  if (g_mixer == NULL) {
+    return 0;
+  }
+
+  if (!strcmp(cmd, "volumeup") || !strcmp(cmd, "volumedown")) {
+    int delta = !strcmp(cmd, "volumeup") ? VOLUME_STEP : -VOLUME_STEP;
+    if (mixer_step(g_mixer, delta, &val, &unmuted) < 0) {
+      return 0;
+    }
+    /* The phone (and with it the mute LED) has to follow the unmute */
+    if (unmuted) {
+      ipc_cli_send(g_dacpd, "mute,0");
+    }
+    snprintf(msg, sizeof(msg), "volume,%d", val);
+  } else if (!strcmp(cmd, "mutetoggle")) {
+    if (mixer_mute_toggle(g_mixer, &val) < 0) {
+      return 0;
+    }
+    snprintf(msg, sizeof(msg), "mute,%d", val);
+  } else {
+    return 0;
+  }
+
+  ipc_cli_send(g_dacpd, msg);
+  return 1;
+
+}
+#endif
+
+/* Sends a button command on its way */
+static void button_cmd(const char *cmd) {
+#ifdef HAVE_ALSA
+  if (mixer_cmd(cmd)) {
+    return;
+  }
+#endif
+  ipc_cli_send(g_dacpd, cmd);
+}
+
+/* Debounces button press events.  Returns 1 if the event counts */
+static int debounce(pin_t *pin, int window_ms) {
 
   struct timespec deltatime;
   struct timespec nowtime;
@@ -92,95 +195,290 @@ static void debounce(button_t *button) {
   clock_gettime(CLOCK_MONOTONIC, &nowtime);
 
   /* Calculate delta time since last press event */
-  if ((nowtime.tv_nsec - button->time.tv_nsec) < 0) {
-    deltatime.tv_sec  = nowtime.tv_sec  - button->time.tv_sec  - 1;
-    deltatime.tv_nsec = nowtime.tv_nsec - button->time.tv_nsec + 1000000000;
+  if ((nowtime.tv_nsec - pin->time.tv_nsec) < 0) {
+    deltatime.tv_sec  = nowtime.tv_sec  - pin->time.tv_sec  - 1;
+    deltatime.tv_nsec = nowtime.tv_nsec - pin->time.tv_nsec + 1000000000;
   } else {
-    deltatime.tv_sec  = nowtime.tv_sec  - button->time.tv_sec;
-    deltatime.tv_nsec = nowtime.tv_nsec - button->time.tv_nsec;
+    deltatime.tv_sec  = nowtime.tv_sec  - pin->time.tv_sec;
+    deltatime.tv_nsec = nowtime.tv_nsec - pin->time.tv_nsec;
   }
 
-  /* Store new time stamp in button */
-  button->time.tv_sec  = nowtime.tv_sec;
-  button->time.tv_nsec = nowtime.tv_nsec;
+  /* Store new time stamp in pin */
+  pin->time.tv_sec  = nowtime.tv_sec;
+  pin->time.tv_nsec = nowtime.tv_nsec;
 
   /* Filter if less than our threshold */
-  if (!((deltatime.tv_sec == 0) && (deltatime.tv_nsec < DEBOUNCE_NSEC))) {
-    ipc_cli_send(g_dacpd, button->cmd);
+  return !((deltatime.tv_sec == 0) && (deltatime.tv_nsec < window_ms * 1000000L));
+}
+
+/* Mapping generation, changes on every reload */
+static unsigned conf_gen(void) {
+  pthread_mutex_lock(&g_conf_lock);
+  unsigned gen = g_conf_gen;
+  pthread_mutex_unlock(&g_conf_lock);
+  return gen;
+}
+
+/* Common ISR body, looks the GPIO up in the current table */
+static void dispatch(int gpio) {
+
+  pin_t *pin = &g_pins[gpio];
+  conf_button_t button;
+  unsigned gen;
+
+  /* Level right after the edge tells which way it went */
+  int level = digitalRead(gpio);
+
+  pthread_mutex_lock(&g_conf_lock);
+  if (pin->button < 0) {
+    pthread_mutex_unlock(&g_conf_lock);
+    return;
   }
+  button = g_conf.buttons[pin->button];
+  gen = g_conf_gen;
+  pthread_mutex_unlock(&g_conf_lock);
+
+  if ((button.edge == CONF_EDGE_FALLING && level != LOW) ||
+      (button.edge == CONF_EDGE_RISING && level != HIGH)) {
+    return;
+  }
+
+  if (!debounce(pin, button.debounce_ms)) {
+    return;
+  }
+
+  button_cmd(button.cmd);
+
+  if (button.repeat_delay_ms == 0) {
+    return;
+  }
+
+  /* Repeat while held.  Each GPIO has its own ISR thread, so other
+   * buttons carry on meanwhile and edges on this one wait in the kernel */
+  delay(button.repeat_delay_ms);
+  while (digitalRead(gpio) == LOW && conf_gen() == gen) {
+    button_cmd(button.cmd);
+    delay(button.repeat_ms);
+  }
+
+  /* Release bounce after a long hold must not count as a press */
+  clock_gettime(CLOCK_MONOTONIC, &pin->time);
+
 }
 
-/* GPIO ISRs */
-static void isr_vup(void)   { debounce(g_buttons.vup);   }
-static void isr_vdown(void) { debounce(g_buttons.vdown); }
-static void isr_mute(void)  { debounce(g_buttons.mute);  }
-static void isr_next(void)  { debounce(g_buttons.next);  }
-static void isr_prev(void)  { debounce(g_buttons.prev);  }
-static void isr_pause(void) { debounce(g_buttons.pause); }
-
-/* Create a new button */
-static button_t* button_new(int id, const char* cmd, button_isr isr) {
-
-  /* Allocate new button */
-  button_t *button = (button_t *)malloc(sizeof(button_t));
-  if (button == NULL) {
-    fprintf(stderr, "FATAL: Cannot allocate button struct\n");
-    exit(1);
+/* GPIO ISRs.  wiringPi ISRs take no argument, so there is one per GPIO */
+#define ISR(n) static void isr_##n(void) { dispatch(n); }
+ISR(0)  ISR(1)  ISR(2)  ISR(3)  ISR(4)  ISR(5)  ISR(6)
+ISR(7)  ISR(8)  ISR(9)  ISR(10) ISR(11) ISR(12) ISR(13)
+ISR(14) ISR(15) ISR(16) ISR(17) ISR(18) ISR(19) ISR(20)
+ISR(21) ISR(22) ISR(23) ISR(24) ISR(25) ISR(26) ISR(27)
+
+static void (* const g_isrs[CONF_PINS])(void) = {
+  isr_0,  isr_1,  isr_2,  isr_3,  isr_4,  isr_5,  isr_6,
+  isr_7,  isr_8,  isr_9,  isr_10, isr_11, isr_12, isr_13,
+  isr_14, isr_15, isr_16, isr_17, isr_18, isr_19, isr_20,
+  isr_21, isr_22, isr_23, isr_24, isr_25, isr_26, isr_27,
+};
+
+/* LED role names, as in the config file */
+static const char *g_led_roles[] = { "ready", "active", "muted" };
+
+/* Returns 1 if conf drives gpio as an LED */
+static int conf_has_led(const conf_t *conf, int gpio) {
+  int i;
+  for (i = 0; i < conf->nleds; i++) {
+    if (conf->leds[i].gpio == gpio) {
+      return 1;
+    }
   }
+  return 0;
+}
 
-  /* Init data */
-  button->id = id;
-  button->isr = isr;
-  button->time.tv_sec = 0;
-  button->time.tv_nsec = 0;
-  strncpy(button->cmd, cmd, 32);
+/*
+ * Makes conf the active mapping.  ISRs are registered the first time a
+ * GPIO is used as a button and never torn down (wiringPi can't), always
+ * for both edges so a reload can change the edge in software.  Events
+ * already queued on a GPIO are handled under whatever table is current
+ * when they run, so nothing in flight is dropped by a reload.
+ */
+static void conf_apply(const conf_t *conf) {
 
-  /* Enable pull up resistor */
-  pullUpDnControl(button->id, PUD_UP);
+  int i;
 
-  /* Register ISR */
-  if (wiringPiISR(button->id, INT_EDGE_FALLING, button->isr) != 0) { 
-    fprintf(stderr, "FATAL: Cannot setup ISR on button %d (%s)\n", button->id, button->cmd); 
-    exit(1);
+  /* LEDs going away are switched off before being given up */
+  for (i = 0; i < g_conf.nleds; i++) {
+    if (!conf_has_led(conf, g_conf.leds[i].gpio)) {
+      digitalWrite(g_conf.leds[i].gpio, LOW);
+    }
   }
 
-  /* Debug */
-  fprintf(stderr, "New button %-11s on gpio %2d @ isr %p\n", button->cmd, button->id, button->isr);
+  /* Inputs are set up before they show up in the table */
+  for (i = 0; i < conf->nbuttons; i++) {
+
+    const conf_button_t *button = &conf->buttons[i];
+    pin_t *pin = &g_pins[button->gpio];
 
-  return button;
+    /* Enable pull up resistor */
+    pinMode(button->gpio, INPUT);
+    pullUpDnControl(button->gpio, PUD_UP);
+
+    /* Register ISR */
+    if (!pin->armed) {
+      if (wiringPiISR(button->gpio, INT_EDGE_BOTH, g_isrs[button->gpio]) != 0) { 
+        fprintf(stderr, "ERROR: Cannot setup ISR on button %d (%s)\n", button->gpio, button->cmd); 
+        continue;
+      }
+      pin->armed = 1;
+    }
+
+    /* Debug */
+    fprintf(stderr, "Button %-11s on gpio %2d%s\n", button->cmd, button->gpio,
+      button->repeat_delay_ms ? " (repeats)" : "");
+
+  }
+
+  /* Swap the table */
+  pthread_mutex_lock(&g_conf_lock);
+  g_conf = *conf;
+  for (i = 0; i < CONF_PINS; i++) {
+    g_pins[i].button = -1;
+  }
+  for (i = 0; i < conf->nbuttons; i++) {
+    g_pins[conf->buttons[i].gpio].button = i;
+  }
+  g_conf_gen++;
+  pthread_mutex_unlock(&g_conf_lock);
+
+  /* Set mode to output, then drive from the current state */
+  for (i = 0; i < conf->nleds; i++) {
+    pinMode(conf->leds[i].gpio, OUTPUT);
+    fprintf(stderr, "LED %-6s on gpio %2d\n", 
+      g_led_roles[conf->leds[i].role], conf->leds[i].gpio);
+  }
+  leds_update();
 
 }
 
-/* Create a new button */
-static led_t* led_new(int id, const char* color, int status) {
+/* Loads the config at path, falling back to the built-in wiring */
+static void conf_init(conf_t *conf, const char *path) {
+  conf_defaults(conf);
+  if (access(path, F_OK) < 0 && errno == ENOENT) {
+    fprintf(stderr, "No %s, using built-in wiring\n", path);
+  } else if (conf_load(conf, path) < 0) {
+    fprintf(stderr, "WARNING: Using built-in wiring\n");
+  }
+}
 
-  /* Allocate new button */
-  led_t *led = (led_t *)malloc(sizeof(led_t));
-  if (led == NULL) {
-    fprintf(stderr, "FATAL: Cannot allocate LED struct\n");
-    exit(1);
+/* Reloads the config, keeping the current mapping if it's broken */
+static void conf_reload(const char *path) {
+  conf_t conf;
+  if (conf_load(&conf, path) < 0) {
+    fprintf(stderr, "WARNING: Keeping current mapping\n");
+    return;
+  }
+  fprintf(stderr, "Reloading %s\n", path);
+  conf_apply(&conf);
+}
+
+/* Watches the directory holding path, since editors tend to replace
+ * files rather than write them in place.  Returns an fd or -1 */
+static int conf_watch(const char *path) {
+
+  char dir[256];
+  char *slash;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  slash = strrchr(dir, '/');
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else if (slash == dir) {
+    dir[1] = '\0';
+  } else {
+    *slash = '\0';
   }
 
-  /* Init data */
-  led->id = id;
-  led->status = status;
-  strncpy(led->color, color, 32);
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    fprintf(stderr, "WARNING: Cannot watch %s (%s), reload with SIGHUP\n", dir, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
 
-  /* Set mode to output */
-  pinMode(led->id, OUTPUT);
+  return fd;
 
-  /* Drive on or OFF */
-  digitalWrite(led->id, status);
+}
 
-  /* Debug */
-  fprintf(stderr, "New %s LED on gpio %2d: %s\n", led->color, led->id, led->status ? "ON" : "OFF");
+/* Drains the watch.  Returns 1 if path was among the changes */
+static int conf_changed(int fd, const char *path) {
+
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  int changed = 0;
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    char *p = buf;
+    while (p < buf + n) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      if (ev->len && !strcmp(ev->name, base)) {
+        changed = 1;
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
 
-  return led;
+  return changed;
 
 }
 
 /* Main */
-int main (void) {
+int main (int argc, char *argv[]) {
+
+  const char *card = "default";
+  const char *control = NULL;
+  const char *conf_path = CONF_PATH;
+  int opt, i, val;
+
+  while ((opt = getopt(argc, argv, "c:D:m:")) != -1) {
+    switch (opt) {
+    case 'c':
+      conf_path = optarg;
+      break;
+    case 'D':
+      card = optarg;
+      break;
+    case 'm':
+      control = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-c config] [-D card] [-m mixer_control]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+#ifdef HAVE_ALSA
+  /* Optional local volume/mute fast path */
+  if (control != NULL) {
+    g_mixer = mixer_new(card, control);
+    if (g_mixer == NULL) {
+      fprintf(stderr, "WARNING: Mixer unavailable, volume goes via DACP only\n");
+    }
+  }
+#else
+  if (control != NULL) {
+    fprintf(stderr, "WARNING: Built without ALSA, ignoring -m %s (card %s)\n", control, card);
+  }
+#endif
+
+  /* SIGHUP reloads the config.  Blocked before any ISR thread exists so
+   * it is only ever picked up by the main loop. */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGHUP);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  int sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
 
   /* Use GPIO numbering scheme */
   wiringPiSetupGpio();
@@ -188,17 +486,11 @@ int main (void) {
   /* Create our DACPD comm channel */
   g_dacpd = ipc_cli_new(DACPD_PORT);
 
-  /* Create our LEDs */
-  g_leds.white = led_new(24, "white", 1);
-  g_leds.green = led_new(23, "green", 0);
-
-  /* Create our buttons */
-  g_buttons.vdown = button_new(13, "volumeup",   isr_vdown);
-  g_buttons.vup   = button_new(26, "volumedown", isr_vup);
-  g_buttons.mute  = button_new( 6, "mutetoggle", isr_mute);
-  g_buttons.next  = button_new(12, "nextitem",   isr_next);
-  g_buttons.prev  = button_new( 5, "previtem",   isr_prev);
-  g_buttons.pause = button_new(16, "playpause",  isr_pause);
+  /* Create our buttons and LEDs */
+  conf_t conf;
+  conf_init(&conf, conf_path);
+  conf_apply(&conf);
+  int conf_fd = conf_watch(conf_path);
 
   /* Open channel for messages */
   ipc_srv_t *gpiod = ipc_srv_new(GPIOD_PORT);
@@ -209,10 +501,58 @@ int main (void) {
 
   /* Service */
   fprintf(stderr, "GPIOD listening for messages on port %d\n", GPIOD_PORT);
-  char msg[256];
+  char msg[IPC_BUF_LEN];
+
+  /* Tell systemd we're up, and keep its watchdog fed from the loop */
+  int wd_msec = ipc_watchdog_msec();
+  long long blink_at = now_msec();
+  struct pollfd pfd[3] = {
+    { .fd = gpiod->sockfd, .events = POLLIN },
+    { .fd = sig_fd,        .events = POLLIN },
+    { .fd = conf_fd,       .events = POLLIN },
+  };
+  ipc_notify("READY=1");
+
   while(1) {
 
-    ipc_srv_recv(gpiod, msg, 256);
+    /* Wake up in time for the next blink while paused */
+    int timeout = wd_msec;
+    if (leds_blinking() && ((timeout < 0) || (timeout > BLINK_MSEC))) {
+      timeout = BLINK_MSEC;
+    }
+
+    int rc = poll(pfd, 3, timeout);
+
+    if (leds_blinking() && (now_msec() - blink_at >= BLINK_MSEC)) {
+      g_blink_on = !g_blink_on;
+      blink_at = now_msec();
+      leds_update();
+    }
+
+    if (wd_msec > 0) {
+      ipc_notify("WATCHDOG=1");
+    }
+
+    if (rc <= 0) {
+      continue;
+    }
+
+    /* Config reload */
+    if (pfd[1].revents & POLLIN) {
+      struct signalfd_siginfo si;
+      while (read(sig_fd, &si, sizeof(si)) == sizeof(si));
+      conf_reload(conf_path);
+    }
+    if ((pfd[2].revents & POLLIN) && conf_changed(conf_fd, conf_path)) {
+      conf_reload(conf_path);
+    }
+    if (!(pfd[0].revents & POLLIN)) {
+      continue;
+    }
+
+    if (ipc_srv_recv(gpiod, msg, sizeof(msg) - 1) != 0) {
+      continue;
+    }
     fprintf(stderr, "msg: %s\n", msg);
 
     /* Shutdown message */
@@ -221,17 +561,40 @@ int main (void) {
       break;
     /* DACP session status messages */
     } else if (!strcmp(msg, "dacp_open")) {
-       digitalWrite(g_leds.green->id, 1);
-       digitalWrite(g_leds.white->id, 0);
+       g_state.session = 1;
+       g_state.reachable = 1;
+       leds_update();
     } else if (!strcmp(msg, "dacp_close")) {
-       digitalWrite(g_leds.green->id, 0);
-       digitalWrite(g_leds.white->id, 1);
+       g_state.session = 0;
+       g_state.playing = -1;
+       g_state.muted = -1;
+       leds_update();
+    /* Session open but the remote can't be reached right now */
+    } else if (!strcmp(msg, "dacp_degraded")) {
+       g_state.session = 1;
+       g_state.reachable = 0;
+       leds_update();
+    /* Playback state from the shairport metadata */
+    } else if (!strcmp(msg, "playing")) {
+       g_state.playing = 1;
+       leds_update();
+    } else if (!strcmp(msg, "paused")) {
+       g_state.playing = 0;
+       g_blink_on = 1;
+       blink_at = now_msec();
+       leds_update();
+    /* Client mute state from the shairport metadata */
+    } else if (sscanf(msg, "mute,%d", &val) == 1) {
+       g_state.muted = val;
+       leds_update();
     }
 
   }
 
-  digitalWrite(g_leds.green->id, 0);
-  digitalWrite(g_leds.white->id, 0);
+  ipc_notify("STOPPING=1");
+  for (i = 0; i < g_conf.nleds; i++) {
+    digitalWrite(g_conf.leds[i].gpio, LOW);
+  }
   fprintf(stderr, "GPIOD exit\n");
 
   return 0;
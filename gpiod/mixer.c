@@ -0,0 +1,317 @@
+/*
+ * ALSA mixer fast path. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "mixer.h"
+
+mixer_t *mixer_new(const char *card, const char *control) {
+
+  mixer_t *mixer = (mixer_t *)malloc(sizeof(mixer_t));
+  if (mixer == NULL) {
+    fprintf(stderr, "ERROR: Cannot allocate mixer_t struct\n");
+    return NULL;
+  }
+  memset(mixer, 0, sizeof(mixer_t));
+  mixer->last_pct = -1;
+
+  int err;
+  if (((err = snd_mixer_open(&mixer->handle, 0)) < 0) ||
+      ((err = snd_mixer_attach(mixer->handle, card)) < 0) ||
+      ((err = snd_mixer_selem_register(mixer->handle, NULL, NULL)) < 0) ||
+      ((err = snd_mixer_load(mixer->handle)) < 0)) {
+    fprintf(stderr, "ERROR: Cannot open mixer %s: %s\n", card, snd_strerror(err));
+    goto fail;
+  }
+
+  snd_mixer_selem_id_t *sid;
+  snd_mixer_selem_id_alloca(&sid);
+  snd_mixer_selem_id_set_index(sid, 0);
+  snd_mixer_selem_id_set_name(sid, control);
+  mixer->elem = snd_mixer_find_selem(mixer->handle, sid);
+  if ((mixer->elem == NULL) || !snd_mixer_selem_has_playback_volume(mixer->elem)) {
+    fprintf(stderr, "ERROR: No playback volume control '%s' on %s\n", control, card);
+    goto fail;
+  }
+
+  snd_mixer_selem_get_playback_volume_range(mixer->elem, &mixer->min, &mixer->max);
+  if (mixer->max <= mixer->min) {
+    fprintf(stderr, "ERROR: Bad volume range on '%s'\n", control);
+    goto fail;
+  }
+
+  /* Without a dB scale we can't follow shairport's curve */
+  if ((snd_mixer_selem_get_playback_dB_range(mixer->elem, &mixer->min_db, &mixer->max_db) == 0) &&
+      (mixer->max_db > mixer->min_db)) {
+    mixer->has_db = 1;
+  } else {
+    fprintf(stderr, "WARNING: '%s' has no dB scale, volume won't match shairport\n", control);
+  }
+
+  mixer->has_switch = snd_mixer_selem_has_playback_switch(mixer->elem);
+  pthread_mutex_init(&mixer->lock, NULL);
+
+  /* Debug */
+  fprintf(stderr, "New mixer '%s' on %s: range %ld..%ld (%.2f..%.2f dB) %s\n", control, card, 
+    mixer->min, mixer->max, mixer->min_db / 100.0, mixer->max_db / 100.0,
+    mixer->has_switch ? "with mute switch" : "");
+
+  return mixer;
+
+fail:
+  if (mixer->handle)
+    snd_mixer_close(mixer->handle);
+  free(mixer);
+  return NULL;
+
+}
+
+static int raw_to_pct(const mixer_t *mixer, long raw) {
+  return (int)(((raw - mixer->min) * 100 + (mixer->max - mixer->min) / 2) / (mixer->max - mixer->min));
+}
+
+static long pct_to_raw(const mixer_t *mixer, int pct) {
+  return mixer->min + ((mixer->max - mixer->min) * pct + 50) / 100;
+}
+
+/*
+ * shairport-sync's standard volume profile (vol2attn() in its common.c),
+ * from AirPlay volume (-30 to 0) to an attenuation in 0.01 dB across the
+ * control's dB range.  Three straight lines, the steepest one wins.
+ */
+static long vol2attn(double vol, long max_db, long min_db) {
+
+  double range_db = max_db - min_db;
+  double first_slope = -range_db / 2;
+  double lines[3][2] = {
+    {   0, first_slope },
+    {  -5, first_slope - (range_db + first_slope) / 2 },
+    { -17, -range_db },
+  };
+  double setting = 0;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    if (vol <= lines[i][0]) {
+      double tvol = lines[i][1] * (vol - lines[i][0]) / (-30 - lines[i][0]);
+      if (tvol < setting) {
+        setting = tvol;
+      }
+    }
+  }
+
+  return (long)(setting + max_db);
+
+}
+
+/* The phone sends 0-100% as AirPlay volume -30 to 0, and 0% as mute */
+static long pct_to_db(const mixer_t *mixer, int pct) {
+  if (pct <= 0) {
+    return mixer->min_db;
+  }
+  return vol2attn(-30.0 + 0.3 * pct, mixer->max_db, mixer->min_db);
+}
+
+/* Inverse of the above, the closest percentage for a dB setting */
+static int db_to_pct(const mixer_t *mixer, long db) {
+  int best = 0;
+  int pct;
+  for (pct = 1; pct <= 100; pct++) {
+    if (labs(pct_to_db(mixer, pct) - db) <= labs(pct_to_db(mixer, best) - db)) {
+      best = pct;
+    }
+  }
+  return best;
+}
+
+/* Someone else (shairport) may have changed the control since we looked */
+static long mixer_get(mixer_t *mixer) {
+  long raw = mixer->min;
+  snd_mixer_handle_events(mixer->handle);
+  snd_mixer_selem_get_playback_volume(mixer->elem, SND_MIXER_SCHN_FRONT_LEFT, &raw);
+  return raw;
+}
+
+/* Current volume in percent */
+static int mixer_get_pct(mixer_t *mixer) {
+  long db = mixer->min_db;
+  if (!mixer->has_db) {
+    return raw_to_pct(mixer, mixer_get(mixer));
+  }
+  snd_mixer_handle_events(mixer->handle);
+  snd_mixer_selem_get_playback_dB(mixer->elem, SND_MIXER_SCHN_FRONT_LEFT, &db);
+  /* Steps near the top are finer than the control, so trust our own
+   * last setting rather than rounding back and drifting */
+  if ((mixer->last_pct >= 0) && (db == mixer->last_db)) {
+    return mixer->last_pct;
+  }
+  return db_to_pct(mixer, db);
+}
+
+/* Sets the volume in percent, rounding towards dir */
+static int mixer_set_pct(mixer_t *mixer, int pct, int dir) {
+  if (!mixer->has_db) {
+    return snd_mixer_selem_set_playback_volume_all(mixer->elem, pct_to_raw(mixer, pct));
+  }
+  int err = snd_mixer_selem_set_playback_dB_all(mixer->elem, pct_to_db(mixer, pct), dir);
+  if (err == 0) {
+    mixer->last_pct = pct;
+    snd_mixer_selem_get_playback_dB(mixer->elem, SND_MIXER_SCHN_FRONT_LEFT, &mixer->last_db);
+  }
+  return err;
+}
+
+/* Called with lock held */
+static int mixer_set_mute(mixer_t *mixer, int muted) {
+
+  int err;
+
+  if (mixer->has_switch) {
+    err = snd_mixer_selem_set_playback_switch_all(mixer->elem, !muted);
+  } else if (muted) {
+    mixer->unmute_vol = mixer_get(mixer);
+    err = snd_mixer_selem_set_playback_volume_all(mixer->elem, mixer->min);
+  } else {
+    err = snd_mixer_selem_set_playback_volume_all(mixer->elem, mixer->unmute_vol);
+  }
+
+  if (err < 0) {
+    fprintf(stderr, "ERROR: Cannot %s mixer: %s\n", muted ? "mute" : "unmute", snd_strerror(err));
+    return -1;
+  }
+
+  mixer->muted = muted;
+  return 0;
+
+}
+
+int mixer_step(mixer_t *mixer, int delta, int *pct, int *unmuted) {
+
+  int rc = 0;
+
+  pthread_mutex_lock(&mixer->lock);
+
+  /* Any volume change unmutes */
+  *unmuted = mixer->muted;
+  if (mixer->muted && (mixer_set_mute(mixer, 0) < 0)) {
+    *unmuted = 0;
+    rc = -1;
+    goto done;
+  }
+
+  int vol = mixer_get_pct(mixer) + delta;
+  if (vol > 100) vol = 100;
+  if (vol < 0)   vol = 0;
+
+  int err = mixer_set_pct(mixer, vol, (delta > 0) ? 1 : -1);
+  if (err < 0) {
+    fprintf(stderr, "ERROR: Cannot set mixer volume: %s\n", snd_strerror(err));
+    rc = -1;
+    goto done;
+  }
+
+  *pct = vol;
+
+done:
+  pthread_mutex_unlock(&mixer->lock);
+  return rc;
+
+}
+
+int mixer_mute_toggle(mixer_t *mixer, int *muted) {
+
+  int rc;
+
+  pthread_mutex_lock(&mixer->lock);
+
+  /* Pick up mute changes made behind our back */
+  if (mixer->has_switch) {
+    int on = 1;
+    snd_mixer_handle_events(mixer->handle);
+    snd_mixer_selem_get_playback_switch(mixer->elem, SND_MIXER_SCHN_FRONT_LEFT, &on);
+    mixer->muted = !on;
+  }
+
+  rc = mixer_set_mute(mixer, !mixer->muted);
+  *muted = mixer->muted;
+
+  pthread_mutex_unlock(&mixer->lock);
+  return rc;
+
+}
+
+#ifdef MIXER_TEST
+/* Exercises a real control.  On a headless box without a sound card, see
+ * asound-test.conf for a softvol control on top of the null device. */
+int main(int argc, char *argv[]) {
+
+  const char *card = (argc > 1) ? argv[1] : "default";
+  const char *control = (argc > 2) ? argv[2] : "Funke Test";
+  int fails = 0;
+  int a, b, muted, unmuted;
+
+  mixer_t *mixer = mixer_new(card, control);
+  if (mixer == NULL) {
+    return 1;
+  }
+
+  /* Start from a known volume */
+  mixer_step(mixer, -100, &a, &unmuted);
+  mixer_step(mixer, 50, &a, &unmuted);
+  mixer_step(mixer, 5, &b, &unmuted);
+  fprintf(stderr, "step up:   %d -> %d\n", a, b);
+  fails += (b != 55);
+
+  mixer_step(mixer, -10, &b, &unmuted);
+  fprintf(stderr, "step down: 55 -> %d\n", b);
+  fails += (b != 45);
+
+  mixer_step(mixer, 200, &b, &unmuted);
+  fprintf(stderr, "clamp:     %d\n", b);
+  fails += (b != 100);
+
+  mixer_mute_toggle(mixer, &muted);
+  fprintf(stderr, "mute:      %d\n", muted);
+  fails += (muted != 1);
+
+  mixer_mute_toggle(mixer, &muted);
+  fprintf(stderr, "unmute:    %d\n", muted);
+  fails += (muted != 0);
+
+  mixer_mute_toggle(mixer, &muted);
+  mixer_step(mixer, -50, &b, &unmuted);
+  fprintf(stderr, "step unmutes: muted=%d vol=%d reported=%d\n", mixer->muted, b, unmuted);
+  fails += (mixer->muted != 0) || (b != 50) || (unmuted != 1);
+
+  mixer_step(mixer, 5, &b, &unmuted);
+  fails += (unmuted != 0);
+
+  fprintf(stderr, "%s\n", fails ? "FAIL" : "PASS");
+  return fails ? 1 : 0;
+
+}
+#endif
@@ -0,0 +1,74 @@
+/*
+ * ALSA mixer fast path. This file is part of Funke Machine.
+ * Copyright (c) Shane Gehring 2017
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Notes:
+ *   Volume and mute presses normally take the long way around: gpiod
+ *   to dacpd, dacpd to the phone over WiFi, and the phone back to the
+ *   shairport RTSP stream.  When enabled, the mixer is driven directly
+ *   instead and the phone is told about the new value afterwards.  All
+ *   calls are serialized internally since every button ISR runs on its
+ *   own thread.
+ *
+ *   The phone echoes the new volume back and shairport then sets the
+ *   same control itself, using its own volume curve in dB.  Percentages
+ *   are mapped onto dB with that same curve, so the echo lands where we
+ *   already are instead of moving the control again.
+ */
+
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+typedef struct {
+  snd_mixer_t *handle;
+  snd_mixer_elem_t *elem;
+  long min;             /* Raw volume range of the control */
+  long max;
+  int has_db;           /* Control has a dB scale */
+  long min_db;          /* dB range of the control (0.01 dB units) */
+  long max_db;
+  int last_pct;         /* Last volume we set, -1=none */
+  long last_db;         /* and the dB it actually landed on */
+  int has_switch;       /* Control has a playback (mute) switch */
+  long unmute_vol;      /* Volume to restore when muted without a switch */
+  int muted;
+  pthread_mutex_t lock;
+} mixer_t;
+
+/* Opens the named simple mixer control (e.g. "Digital") on card
+ * (e.g. "default" or "hw:0") */
+mixer_t *mixer_new(const char *card, const char *control);
+
+/* Changes the volume by delta percent.  New volume (0-100) is returned
+ * in pct, unmuted is set to 1 if the step had to unmute first (any
+ * volume change unmutes).  Returns 0 on success, -1 on error */
+int mixer_step(mixer_t *mixer, int delta, int *pct, int *unmuted);
+
+/* Toggles mute.  New state (1=muted) is returned in muted.  Returns 0
+ * on success, -1 on error */
+int mixer_mute_toggle(mixer_t *mixer, int *muted);
+
+#endif /* MIXER_H */
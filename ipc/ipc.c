@@ -27,10 +27,83 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/un.h>
 
 #include "ipc.h"
 
+/* First fd passed by systemd socket activation */
+#define LISTEN_FDS_START (3)
+
+/* Framed messages start with a header: SOH, kind, 32 bit sequence
+ * number (network order).  Anything else is a plain string (nc, the
+ * shairport fork) and is passed through untouched. */
+#define IPC_SOH      (0x01)
+#define IPC_DATAGRAM ('D')
+#define IPC_RELIABLE ('R')
+#define IPC_ACK      ('A')
+
+/* Reliable mode: resend after 20, 40, 80, 160, 320 msec then give up */
+#define IPC_RETRY_MSEC (20)
+#define IPC_RETRIES    (5)
+
+/* Sequence numbers this far behind are duplicates, further back means
+ * the sender restarted (and happened to reuse the port) */
+#define IPC_DUP_WINDOW (64)
+
+static void ipc_hdr(char *buf, char kind, uint32_t seq) {
+  buf[0] = IPC_SOH;
+  buf[1] = kind;
+  buf[2] = (seq >> 24) & 0xff;
+  buf[3] = (seq >> 16) & 0xff;
+  buf[4] = (seq >> 8) & 0xff;
+  buf[5] = seq & 0xff;
+}
+
+static uint32_t ipc_hdr_seq(const char *buf) {
+  const unsigned char *b = (const unsigned char *)buf;
+  return ((uint32_t)b[2] << 24) | ((uint32_t)b[3] << 16) | ((uint32_t)b[4] << 8) | b[5];
+}
+
+/* Returns the datagram socket for port that systemd already bound for
+ * us (socket activation), or -1 if there is none */
+static int ipc_listen_fd(int port) {
+
+  const char *pid = getenv("LISTEN_PID");
+  const char *fds = getenv("LISTEN_FDS");
+
+  if ((pid == NULL) || (fds == NULL) || (atoi(pid) != getpid())) {
+    return -1;
+  }
+
+  int fd;
+  for (fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + atoi(fds); fd++) {
+    int type = 0;
+    socklen_t typelen = sizeof(type);
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+
+    if ((getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typelen) < 0) || (type != SOCK_DGRAM)) {
+      continue;
+    }
+    if (getsockname(fd, (struct sockaddr *)&ss, &sslen) < 0) {
+      continue;
+    }
+    if (((ss.ss_family == AF_INET)  && (ntohs(((struct sockaddr_in *)&ss)->sin_port) == port)) ||
+        ((ss.ss_family == AF_INET6) && (ntohs(((struct sockaddr_in6 *)&ss)->sin6_port) == port))) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      return fd;
+    }
+  }
+
+  return -1;
+
+}
+
 ipc_srv_t *ipc_srv_new(int port) {
 
   ipc_srv_t *srv = (ipc_srv_t *)malloc(sizeof(ipc_srv_t));
@@ -39,7 +112,18 @@ ipc_srv_t *ipc_srv_new(int port) {
     return NULL;
   }
 
+  memset(srv, 0, sizeof(ipc_srv_t));
   srv->port = port;
+
+  /* Already bound by systemd, messages sent while we were starting up
+   * are waiting in its receive queue */
+  srv->sockfd = ipc_listen_fd(port);
+  if (srv->sockfd >= 0) {
+    socklen_t salen = sizeof(srv->si);
+    getsockname(srv->sockfd, (struct sockaddr *)&srv->si, &salen);
+    return srv;
+  }
+
   srv->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (srv->sockfd < 0) {
     fprintf(stderr, "ERROR: Cannot create socket fd\n");
@@ -60,7 +144,62 @@ ipc_srv_t *ipc_srv_new(int port) {
 
 }
 
-int ipc_srv_recv(const ipc_srv_t *srv, char *msg, int maxlen) {
+/* Sequence bookkeeping per sender.  Returns 1 if the message is new,
+ * 0 if it is a duplicate that should be dropped.  Only reliable messages
+ * are ever resent, so only those can be duplicates.  A datagram behind
+ * the expected sequence number was reordered (gpiod sends from several
+ * ISR threads at once) and is still delivered. */
+static int ipc_srv_track(ipc_srv_t *srv, int port, int mode, uint32_t seq) {
+
+  ipc_stats_t *stats = &srv->stats[mode];
+  ipc_peer_t *peer = NULL;
+  int i;
+
+  for (i = 0; i < IPC_PEERS; i++) {
+    if (srv->peers[i].port == port) {
+      peer = &srv->peers[i];
+      break;
+    }
+  }
+
+  /* New sender, take over the oldest slot */
+  if (peer == NULL) {
+    peer = &srv->peers[srv->peer_next];
+    srv->peer_next = (srv->peer_next + 1) % IPC_PEERS;
+    memset(peer, 0, sizeof(ipc_peer_t));
+    peer->port = port;
+  }
+
+  int32_t d = (int32_t)(seq - peer->next[mode]);
+
+  if (peer->synced[mode] && (d < 0) && (d >= -IPC_DUP_WINDOW)) {
+    if (mode == IPC_MODE_RELIABLE) {
+      stats->dups++;
+      return 0;
+    }
+    /* Counted as lost when the later one overtook it */
+    stats->reorders++;
+    if (stats->gaps > 0) {
+      stats->gaps--;
+    }
+    stats->msgs++;
+    return 1;
+  }
+
+  if (peer->synced[mode] && (d > 0)) {
+    stats->gaps += d;
+    fprintf(stderr, "ipc: %d %s message(s) from port %d lost\n", d, 
+      mode == IPC_MODE_RELIABLE ? "reliable" : "datagram", port);
+  }
+
+  peer->synced[mode] = 1;
+  peer->next[mode] = seq + 1;
+  stats->msgs++;
+  return 1;
+
+}
+
+int ipc_srv_recv(ipc_srv_t *srv, char *msg, int maxlen) {
 
   if (srv == NULL)  {
      return -1;
@@ -70,13 +209,50 @@ int ipc_srv_recv(const ipc_srv_t *srv, char *msg, int maxlen) {
      return -1;
   }
 
-  struct sockaddr sa;
+  struct sockaddr_storage sa;
   socklen_t salen = sizeof(sa);
-  int i = recvfrom(srv->sockfd, msg, maxlen, 0, &sa, &salen);
-  if (i > 0) {
-    msg[i] = 0;
+  int i = recvfrom(srv->sockfd, msg, maxlen, MSG_TRUNC, (struct sockaddr *)&sa, &salen);
+  if (i <= 0) {
+    return -1;
+  }
+
+  /* MSG_TRUNC reports the full datagram length.  A truncated reliable
+   * message would be acked and then acted on half read, drop it. */
+  if (i > maxlen) {
+    fprintf(stderr, "ipc: dropped %d byte message, buffer holds %d\n", i, maxlen);
+    return 1;
+  }
+  msg[i] = 0;
+
+  /* Plain string message */
+  if ((i < IPC_HDR_LEN) || (msg[0] != IPC_SOH)) {
+    return 0;
+  }
+
+  uint32_t seq = ipc_hdr_seq(msg);
+  int mode;
+  if (msg[1] == IPC_RELIABLE) {
+    mode = IPC_MODE_RELIABLE;
+  } else if (msg[1] == IPC_DATAGRAM) {
+    mode = IPC_MODE_DATAGRAM;
+  } else {
+    return 1;
+  }
+
+  /* Ack duplicates too, the first ack may have been the one lost */
+  if (mode == IPC_MODE_RELIABLE) {
+    char ack[IPC_HDR_LEN];
+    ipc_hdr(ack, IPC_ACK, seq);
+    sendto(srv->sockfd, ack, sizeof(ack), 0, (struct sockaddr *)&sa, salen);
+  }
+
+  int port = (sa.ss_family == AF_INET6) ? 
+    ntohs(((struct sockaddr_in6 *)&sa)->sin6_port) : ntohs(((struct sockaddr_in *)&sa)->sin_port);
+  if (!ipc_srv_track(srv, port, mode, seq)) {
+    return 1;
   }
 
+  memmove(msg, msg + IPC_HDR_LEN, i - IPC_HDR_LEN + 1);
   return 0;
 
 }
@@ -89,6 +265,15 @@ ipc_cli_t *ipc_cli_new(int port) {
     return NULL;
   }
 
+  memset(cli, 0, sizeof(ipc_cli_t));
+  cli->port = port;
+  pthread_mutex_init(&cli->lock, NULL);
+
+  /* Start somewhere random so a restarted client that gets the same
+   * port isn't mistaken for the old one */
+  cli->seq[IPC_MODE_DATAGRAM] = (uint32_t)time(NULL) * 2654435761u ^ (uint32_t)getpid();
+  cli->seq[IPC_MODE_RELIABLE] = cli->seq[IPC_MODE_DATAGRAM] ^ 0x5a5a5a5a;
+
   cli->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   memset(&cli->si, 0, sizeof(cli->si));
   cli->si.sin_family = AF_INET;
@@ -99,23 +284,169 @@ ipc_cli_t *ipc_cli_new(int port) {
 
 }
 
-int ipc_cli_send(const ipc_cli_t *cli, const char *msg) {
-  sendto(cli->sockfd, msg, strlen(msg)+1, 0, (struct sockaddr *)&cli->si, sizeof(cli->si));
+/* Builds a framed message in buf, returns its length or -1.  The NUL
+ * is not sent, ipc_srv_recv() terminates what it receives. */
+static int ipc_frame(char *buf, int maxlen, char kind, uint32_t seq, const char *msg) {
+  int n = strlen(msg);
+  if (IPC_HDR_LEN + n > maxlen) {
+    fprintf(stderr, "ERROR: ipc message too long\n");
+    return -1;
+  }
+  ipc_hdr(buf, kind, seq);
+  memcpy(buf + IPC_HDR_LEN, msg, n);
+  return IPC_HDR_LEN + n;
+}
+
+int ipc_cli_send(ipc_cli_t *cli, const char *msg) {
+
+  char buf[IPC_HDR_LEN + IPC_MSG_MAX];
+  /* Button ISRs send from several threads at once */
+  uint32_t seq = __sync_fetch_and_add(&cli->seq[IPC_MODE_DATAGRAM], 1);
+  int n = ipc_frame(buf, sizeof(buf), IPC_DATAGRAM, seq, msg);
+  if (n < 0) {
+    return -1;
+  }
+
+  __sync_fetch_and_add(&cli->stats[IPC_MODE_DATAGRAM].msgs, 1);
+  sendto(cli->sockfd, buf, n, 0, (struct sockaddr *)&cli->si, sizeof(cli->si));
   return 0;
+
+}
+
+static long ipc_elapsed_msec(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Waits up to msec for the ack of seq.  Acks for earlier (given up on)
+ * messages are discarded. */
+static int ipc_cli_wait_ack(ipc_cli_t *cli, uint32_t seq, int msec) {
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (1) {
+    long left = msec - ipc_elapsed_msec(&start);
+    if (left <= 0) {
+      return 0;
+    }
+
+    struct pollfd pfd = { .fd = cli->sockfd, .events = POLLIN };
+    if (poll(&pfd, 1, left) <= 0) {
+      return 0;
+    }
+
+    char ack[IPC_HDR_LEN];
+    if ((recv(cli->sockfd, ack, sizeof(ack), 0) == IPC_HDR_LEN) && 
+        (ack[0] == IPC_SOH) && (ack[1] == IPC_ACK) && (ipc_hdr_seq(ack) == seq)) {
+      return 1;
+    }
+  }
+
+}
+
+int ipc_cli_send_reliable(ipc_cli_t *cli, const char *msg) {
+
+  char buf[IPC_HDR_LEN + IPC_MSG_MAX];
+  int rc = -1;
+
+  pthread_mutex_lock(&cli->lock);
+
+  uint32_t seq = cli->seq[IPC_MODE_RELIABLE]++;
+  int n = ipc_frame(buf, sizeof(buf), IPC_RELIABLE, seq, msg);
+  if (n < 0) {
+    goto done;
+  }
+
+  cli->stats[IPC_MODE_RELIABLE].msgs++;
+
+  int try;
+  int wait = IPC_RETRY_MSEC;
+  for (try = 0; try < IPC_RETRIES; try++) {
+    if (try > 0) {
+      cli->stats[IPC_MODE_RELIABLE].retransmits++;
+    }
+    sendto(cli->sockfd, buf, n, 0, (struct sockaddr *)&cli->si, sizeof(cli->si));
+    if (ipc_cli_wait_ack(cli, seq, wait)) {
+      rc = 0;
+      goto done;
+    }
+    wait *= 2;
+  }
+
+  cli->stats[IPC_MODE_RELIABLE].failures++;
+  fprintf(stderr, "ipc: '%s' to port %d not acknowledged\n", msg, cli->port);
+
+done:
+  pthread_mutex_unlock(&cli->lock);
+  return rc;
+
+}
+
+int ipc_notify(const char *state) {
+
+  const char *path = getenv("NOTIFY_SOCKET");
+  if ((path == NULL) || ((path[0] != '/') && (path[0] != '@'))) {
+    return 0;
+  }
+
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+  socklen_t salen = offsetof(struct sockaddr_un, sun_path) + strlen(sa.sun_path);
+
+  /* Abstract namespace */
+  if (sa.sun_path[0] == '@') {
+    sa.sun_path[0] = '\0';
+  }
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  int rc = sendto(fd, state, strlen(state), 0, (struct sockaddr *)&sa, salen);
+  close(fd);
+
+  return (rc < 0) ? -1 : 0;
+
+}
+
+int ipc_watchdog_msec(void) {
+
+  const char *usec = getenv("WATCHDOG_USEC");
+  const char *pid = getenv("WATCHDOG_PID");
+
+  if ((usec == NULL) || ((pid != NULL) && (atoi(pid) != getpid()))) {
+    return -1;
+  }
+
+  /* Ping at twice the rate systemd expects */
+  long long msec = atoll(usec) / 2000;
+  return (msec > 0) ? (int)msec : -1;
+
 }
 
 #ifdef IPC_TEST_SERVER
 int main(void) {
   ipc_srv_t *srv = ipc_srv_new(12345);
-  char msg[128];
+  char msg[IPC_BUF_LEN];
   fprintf(stderr, "Server active, waiting for messages\n");
   while(1) {
-    ipc_srv_recv(srv, msg, 128);
+    if (ipc_srv_recv(srv, msg, sizeof(msg) - 1) != 0) {
+      continue;
+    }
     fprintf(stderr, "MSG: %s\n", msg);
     if (!strcmp(msg, "exit")) {
       break;
     } 
   }
+  fprintf(stderr, "datagram: msgs=%lu gaps=%lu reorders=%lu\n", srv->stats[IPC_MODE_DATAGRAM].msgs,
+    srv->stats[IPC_MODE_DATAGRAM].gaps, srv->stats[IPC_MODE_DATAGRAM].reorders);
+  fprintf(stderr, "reliable: msgs=%lu gaps=%lu dups=%lu\n", srv->stats[IPC_MODE_RELIABLE].msgs,
+    srv->stats[IPC_MODE_RELIABLE].gaps, srv->stats[IPC_MODE_RELIABLE].dups);
   return 0;
 }
 #endif
@@ -125,7 +456,12 @@ int main(void) {
   ipc_cli_send(cli, "test 1");
   ipc_cli_send(cli, "test 2");
   ipc_cli_send(cli, "test 3");
-  ipc_cli_send(cli, "exit");
+  if (ipc_cli_send_reliable(cli, "test 4 (reliable)") < 0) {
+    fprintf(stderr, "test 4 not acknowledged\n");
+  }
+  fprintf(stderr, "reliable: retransmits=%lu failures=%lu\n", 
+    cli->stats[IPC_MODE_RELIABLE].retransmits, cli->stats[IPC_MODE_RELIABLE].failures);
+  ipc_cli_send_reliable(cli, "exit");
   return 0;
 }
 #endif
@@ -29,41 +29,113 @@
  *   to anyone who happens to be listening.  If the server isn't 
  *   up and listening, the messages just get lost.  This is actually
  *   what I want... lightweight, simple, forgiving.
+ *
+ *   Mostly.  A lost session open/close leaves the LEDs or buttons in
+ *   the wrong state for a whole session.  Messages like that can opt in
+ *   to reliable delivery: they carry a sequence number, the server acks
+ *   them and drops duplicates, and the client resends a few times with
+ *   backoff.  Everything else stays fire and forget (with a sequence
+ *   number, so that losses at least show up in the counters).
+ *
+ *   Only the dacpd -> gpiod hop uses this.  The shairport fork still
+ *   sends dacp_open to dacpd as a plain string, unframed and unacked;
+ *   changing rtsp.c is outside this tree.  It could link ipc.c and call
+ *   ipc_cli_send_reliable(), dacpd already acks framed messages.
  */
 
 #ifndef IPC_H
 #define IPC_H
 
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+/* Longest message (excluding the terminating NUL) */
+#define IPC_MSG_MAX (255)
+
+/* Framing header on the wire, see ipc.c */
+#define IPC_HDR_LEN (6)
+
+/* Receive buffer size that holds any framed message plus the NUL */
+#define IPC_BUF_LEN (IPC_HDR_LEN + IPC_MSG_MAX + 1)
+
+/* Delivery modes */
+#define IPC_MODE_DATAGRAM (0)
+#define IPC_MODE_RELIABLE (1)
+#define IPC_MODES         (2)
+
+/* Delivery counters, kept per mode */
+typedef struct {
+  unsigned long msgs;        /* Messages sent (client) or accepted (server) */
+  unsigned long gaps;        /* Messages missing by sequence number (server) */
+  unsigned long dups;        /* Duplicates dropped (server, reliable) */
+  unsigned long reorders;    /* Late but delivered (server, datagram) */
+  unsigned long retransmits; /* Resends (client, reliable) */
+  unsigned long failures;    /* Never acknowledged (client, reliable) */
+} ipc_stats_t;
+
+/* Per sender sequence tracking (server) */
+#define IPC_PEERS (4)
+typedef struct {
+  int port;
+  int synced[IPC_MODES];
+  uint32_t next[IPC_MODES];
+} ipc_peer_t;
+
 /* Server */
 typedef struct {
   int port;
   int sockfd;
   struct sockaddr_in si;
+  ipc_peer_t peers[IPC_PEERS];
+  int peer_next;
+  ipc_stats_t stats[IPC_MODES];
 } ipc_srv_t;
 
-/* Creates a new server on the specified port */
+/* Creates a new server on the specified port.  If systemd already bound
+ * a datagram socket for the port (socket activation, LISTEN_FDS), that
+ * socket is used instead of creating a new one. */
 ipc_srv_t *ipc_srv_new(int port);
 
 /* Blocks until a new message is received from the client.
  * Note: The msg param must be allocated by the caller and
  * be large enough to accomodate the largest message length
- * (maxlen) */
-int ipc_srv_recv(const ipc_srv_t *srv, char *msg, int maxlen);
+ * (maxlen) plus the terminating NUL.  The header is stripped in
+ * place, so use a char[IPC_BUF_LEN] and pass sizeof(msg) - 1.
+ * Datagrams longer than maxlen are dropped (and logged), not
+ * truncated.
+ * Returns 0 when msg holds a message, 1 when the datagram was
+ * consumed internally (e.g. a duplicate), -1 on error */
+int ipc_srv_recv(ipc_srv_t *srv, char *msg, int maxlen);
 
 /* Client */
 typedef struct {
   int port;
   int sockfd;
   struct sockaddr_in si;
+  uint32_t seq[IPC_MODES];
+  ipc_stats_t stats[IPC_MODES];
+  pthread_mutex_t lock;     /* Serializes reliable sends */
 } ipc_cli_t;
 
 /* Creates a new client connection to the server on the specified port */
 ipc_cli_t *ipc_cli_new(int port);
 
-/* Sends message to the server */
-int ipc_cli_send(const ipc_cli_t *cli, const char *msg);
+/* Sends message to the server (fire and forget) */
+int ipc_cli_send(ipc_cli_t *cli, const char *msg);
+
+/* Sends message to the server and waits for it to be acknowledged,
+ * resending with backoff (worst case blocks ~600 msec).  Returns 0 once
+ * acknowledged, -1 if it never was */
+int ipc_cli_send_reliable(ipc_cli_t *cli, const char *msg);
+
+/* systemd service manager notification (sd_notify), e.g. "READY=1"
+ * or "WATCHDOG=1".  A no-op (returns 0) when not run by systemd. */
+int ipc_notify(const char *state);
+
+/* Interval in msec at which "WATCHDOG=1" should be sent, or -1 if the
+ * watchdog isn't enabled for this process */
+int ipc_watchdog_msec(void);
 
 #endif /* IPC_H */